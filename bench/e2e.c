@@ -0,0 +1,363 @@
+// End-to-end benchmark against the loopback simulator (build/wizsim, started
+// and stopped by this program): blocking command latency with CPU time and
+// heap allocations per command, fleet throughput from 1 to 5000 bulbs, and
+// discovery time. Prints one JSON object per line for regression tracking.
+
+#include "cwiz.h"
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_PATH "build/wizsim"
+#define SIM_BULBS 5000
+#define SIM_FIRST 0x7f000101u // 127.0.1.1
+
+#define BLOCKING_ITERATIONS 2000
+#define FLEET_SOCKETS 4
+#define FLEET_MIN_COMMANDS 20000
+#define FLEET_MIN_ROUNDS 3
+#define DISCOVERY_TIMEOUT_MS 2000
+
+// heap accounting: the program's malloc family forwards to glibc and counts
+// every call, including those made inside the library
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long allocations;
+
+void *malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  allocations++;
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+  __libc_free(ptr);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static double cpu_us(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e6 +
+         (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+static void bulb_ip(int index, char *ip) {
+  uint32_t addr = SIM_FIRST + (uint32_t)index;
+  snprintf(ip, 16, "%u.%u.%u.%u", addr >> 24, (addr >> 16) & 0xff,
+           (addr >> 8) & 0xff, addr & 0xff);
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// nearest-rank percentile of sorted samples, in microseconds
+static double percentile_us(const uint64_t *sorted, int count, double p) {
+  if (count == 0)
+    return 0;
+  int rank = (int)ceil(p * count) - 1;
+  if (rank < 0)
+    rank = 0;
+  return (double)sorted[rank] / 1000.0;
+}
+
+// simulator
+
+static pid_t sim_pid;
+
+static void sim_stop(void) {
+  if (sim_pid > 0) {
+    kill(sim_pid, SIGTERM);
+    waitpid(sim_pid, NULL, 0);
+    sim_pid = 0;
+  }
+}
+
+static int sim_start(void) {
+  const char *path = getenv("WIZSIM");
+  if (!path)
+    path = SIM_PATH;
+
+  char count[16];
+  snprintf(count, sizeof(count), "%d", SIM_BULBS);
+
+  sim_pid = fork();
+  if (sim_pid < 0)
+    return -1;
+  if (sim_pid == 0) {
+    execl(path, path, "-q", "-n", count, "-a", "127.0.1.1", "-l", "const:0",
+          (char *)NULL);
+    perror(path);
+    _exit(127);
+  }
+
+  // ready once the first bulb answers
+  wiz_bulb_t *bulb = wiz_bulb_create("127.0.1.1");
+  if (!bulb)
+    return -1;
+  for (int i = 0; i < 50; i++) {
+    if (waitpid(sim_pid, NULL, WNOHANG) == sim_pid) {
+      sim_pid = 0;
+      break;
+    }
+    if (wiz_bulb_update_state(bulb) == WIZ_OK) {
+      wiz_bulb_destroy(bulb);
+      return 0;
+    }
+  }
+  wiz_bulb_destroy(bulb);
+  return -1;
+}
+
+// blocking calls
+
+typedef enum {
+  OP_SET_STATE,
+  OP_SET_BRIGHTNESS,
+  OP_SET_RGB,
+  OP_SET_TEMPERATURE,
+  OP_SET_SCENE,
+  OP_APPLY_PILOT,
+  OP_UPDATE_STATE,
+  OP_COUNT
+} blocking_op_t;
+
+static const char *op_names[OP_COUNT] = {
+    "wiz_bulb_set_state",       "wiz_bulb_set_brightness",
+    "wiz_bulb_set_rgb",         "wiz_bulb_set_temperature",
+    "wiz_bulb_set_scene",       "wiz_bulb_apply_pilot",
+    "wiz_bulb_update_state",
+};
+
+static int run_op(wiz_bulb_t *bulb, blocking_op_t op, int i) {
+  switch (op) {
+  case OP_SET_STATE:
+    return (i & 1) ? wiz_bulb_turn_on(bulb) : wiz_bulb_turn_off(bulb);
+  case OP_SET_BRIGHTNESS:
+    return wiz_bulb_set_brightness(bulb, (uint8_t)(10 + i % 91));
+  case OP_SET_RGB:
+    return wiz_bulb_set_rgb(bulb, (uint8_t)i, (uint8_t)(i >> 3), 200);
+  case OP_SET_TEMPERATURE:
+    return wiz_bulb_set_temperature(bulb, (uint16_t)(2200 + i % 4300));
+  case OP_SET_SCENE:
+    return wiz_bulb_set_scene(bulb, (uint16_t)(1 + i % 32));
+  case OP_APPLY_PILOT: {
+    wiz_pilot_builder_t builder = {0};
+    wiz_pilot_builder_set_state(&builder, true);
+    wiz_pilot_builder_set_brightness(&builder, (uint8_t)(10 + i % 91));
+    wiz_pilot_builder_set_rgb(&builder, (uint8_t)i, 64, 255);
+    return wiz_bulb_apply_pilot(bulb, &builder);
+  }
+  default:
+    return wiz_bulb_update_state(bulb);
+  }
+}
+
+static int bench_blocking(void) {
+  static uint64_t samples[BLOCKING_ITERATIONS];
+  wiz_bulb_t *bulb = wiz_bulb_create("127.0.1.1");
+  if (!bulb)
+    return 1;
+
+  for (int op = 0; op < OP_COUNT; op++) {
+    int errors = 0;
+    double cpu_start = cpu_us();
+    unsigned long alloc_start = allocations;
+
+    for (int i = 0; i < BLOCKING_ITERATIONS; i++) {
+      uint64_t start = now_ns();
+      if (run_op(bulb, (blocking_op_t)op, i) != WIZ_OK)
+        errors++;
+      samples[i] = now_ns() - start;
+    }
+
+    double cpu = cpu_us() - cpu_start;
+    unsigned long allocs = allocations - alloc_start;
+    qsort(samples, BLOCKING_ITERATIONS, sizeof(samples[0]), compare_u64);
+
+    printf("{\"bench\":\"blocking\",\"op\":\"%s\",\"commands\":%d,"
+           "\"errors\":%d,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,"
+           "\"cpu_us_per_cmd\":%.2f,\"allocs_per_cmd\":%.3f}\n",
+           op_names[op], BLOCKING_ITERATIONS, errors,
+           percentile_us(samples, BLOCKING_ITERATIONS, 0.50),
+           percentile_us(samples, BLOCKING_ITERATIONS, 0.99),
+           percentile_us(samples, BLOCKING_ITERATIONS, 0.999),
+           cpu / BLOCKING_ITERATIONS, (double)allocs / BLOCKING_ITERATIONS);
+    fflush(stdout);
+  }
+
+  wiz_bulb_destroy(bulb);
+  return 0;
+}
+
+// fleet throughput: every round sends one setPilot to each bulb and waits for
+// all of them; latency runs from submission to the callback
+
+typedef struct {
+  uint64_t *submitted; // per bulb, this round
+  uint64_t *samples;
+  int sample_count;
+  int errors;
+} fleet_run_t;
+
+static fleet_run_t run;
+
+static void on_fleet_done(wiz_bulb_t *bulb, int result,
+                          const wiz_bulb_state_t *state, void *user_data) {
+  (void)bulb;
+  (void)state;
+  int index = (int)(intptr_t)user_data;
+  run.samples[run.sample_count++] = now_ns() - run.submitted[index];
+  if (result != WIZ_OK)
+    run.errors++;
+}
+
+static int bench_fleet(int size) {
+  wiz_fleet_t *fleet = wiz_fleet_create_pool(FLEET_SOCKETS);
+  wiz_bulb_t **bulbs = (wiz_bulb_t **)calloc((size_t)size, sizeof(*bulbs));
+  if (!fleet || !bulbs)
+    return 1;
+
+  char ip[16];
+  for (int i = 0; i < size; i++) {
+    bulb_ip(i, ip);
+    bulbs[i] = wiz_bulb_create_shared(fleet, ip);
+    if (!bulbs[i])
+      return 1;
+  }
+
+  int rounds = FLEET_MIN_COMMANDS / size;
+  if (rounds < FLEET_MIN_ROUNDS)
+    rounds = FLEET_MIN_ROUNDS;
+  int total = rounds * size;
+
+  run.submitted = (uint64_t *)calloc((size_t)size, sizeof(uint64_t));
+  run.samples = (uint64_t *)calloc((size_t)total, sizeof(uint64_t));
+  run.sample_count = 0;
+  run.errors = 0;
+  if (!run.submitted || !run.samples)
+    return 1;
+
+  double cpu_start = cpu_us();
+  unsigned long alloc_start = allocations;
+  uint64_t start = now_ns();
+
+  for (int round = 0; round < rounds; round++) {
+    wiz_pilot_builder_t builder = {0};
+    wiz_pilot_builder_set_rgb(&builder, (uint8_t)round, 128, 255);
+    for (int i = 0; i < size; i++) {
+      run.submitted[i] = now_ns();
+      if (wiz_fleet_apply_pilot(fleet, bulbs[i], &builder, on_fleet_done,
+                                (void *)(intptr_t)i) != WIZ_OK) {
+        run.samples[run.sample_count++] = 0;
+        run.errors++;
+      }
+    }
+    wiz_fleet_run(fleet);
+  }
+
+  double elapsed_s = (double)(now_ns() - start) / 1e9;
+  double cpu = cpu_us() - cpu_start;
+  unsigned long allocs = allocations - alloc_start;
+  qsort(run.samples, (size_t)run.sample_count, sizeof(uint64_t), compare_u64);
+
+  printf("{\"bench\":\"fleet\",\"bulbs\":%d,\"sockets\":%d,\"commands\":%d,"
+         "\"errors\":%d,\"cmds_per_s\":%.0f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+         "\"p999_us\":%.1f,\"cpu_us_per_cmd\":%.2f,\"allocs_per_cmd\":%.3f}\n",
+         size, FLEET_SOCKETS, total, run.errors, total / elapsed_s,
+         percentile_us(run.samples, run.sample_count, 0.50),
+         percentile_us(run.samples, run.sample_count, 0.99),
+         percentile_us(run.samples, run.sample_count, 0.999), cpu / total,
+         (double)allocs / total);
+  fflush(stdout);
+
+  free(run.submitted);
+  free(run.samples);
+  for (int i = 0; i < size; i++)
+    wiz_bulb_destroy(bulbs[i]);
+  free(bulbs);
+  wiz_fleet_destroy(fleet);
+  return 0;
+}
+
+// discovery: time until the last simulated bulb has answered
+
+typedef struct {
+  uint64_t start;
+  uint64_t last;
+  int found;
+} discovery_run_t;
+
+static void on_discovered(const wiz_discovered_bulb_t *bulb, void *user_data) {
+  (void)bulb;
+  discovery_run_t *d = (discovery_run_t *)user_data;
+  d->last = now_ns();
+  d->found++;
+}
+
+static int bench_discovery(void) {
+  wiz_bulb_registry_t *registry = wiz_bulb_registry_create();
+  if (!registry)
+    return 1;
+
+  discovery_run_t d = {now_ns(), 0, 0};
+  d.last = d.start;
+  int ret = wiz_discover_bulbs_ex(registry, "127.255.255.255",
+                                  DISCOVERY_TIMEOUT_MS, on_discovered, &d);
+
+  printf("{\"bench\":\"discovery\",\"bulbs\":%d,\"found\":%d,"
+         "\"result\":%d,\"last_reply_ms\":%.1f,\"timeout_ms\":%d}\n",
+         SIM_BULBS, d.found, ret < 0 ? ret : 0,
+         (double)(d.last - d.start) / 1e6, DISCOVERY_TIMEOUT_MS);
+  fflush(stdout);
+
+  wiz_bulb_registry_destroy(registry);
+  return ret < 0;
+}
+
+int main(void) {
+  static const int fleet_sizes[] = {1, 10, 100, 1000, 5000};
+
+  if (sim_start() != 0) {
+    fprintf(stderr, "e2e: simulator did not come up (is port 38899 free? "
+                    "build it with 'make sim')\n");
+    sim_stop();
+    return 1;
+  }
+
+  int failed = 0;
+  failed |= bench_blocking();
+  for (size_t i = 0; i < sizeof(fleet_sizes) / sizeof(fleet_sizes[0]); i++)
+    failed |= bench_fleet(fleet_sizes[i]);
+  failed |= bench_discovery();
+
+  sim_stop();
+  return failed;
+}
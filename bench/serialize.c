@@ -0,0 +1,121 @@
+// Measures setPilot serialization cost: the previous snprintf-based path
+// against the single-pass writer used by the library.
+
+#include "cwiz.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+extern int wiz_build_pilot_message(char *buffer, size_t size,
+                                   const wiz_pilot_builder_t *builder,
+                                   uint32_t *id);
+
+#define ITERATIONS 2000000
+
+// the serializer as it was before: params through up to six snprintf calls,
+// then framed by another snprintf
+static int legacy_build(char *message, size_t size,
+                        const wiz_pilot_builder_t *builder, unsigned int id) {
+  char params[384];
+  int offset = 1;
+  params[0] = '{';
+
+  if (builder->has_state)
+    offset += snprintf(params + offset, sizeof(params) - offset,
+                       "\"state\":%s,", builder->state ? "true" : "false");
+  if (builder->has_brightness)
+    offset += snprintf(params + offset, sizeof(params) - offset,
+                       "\"dimming\":%d,", builder->brightness);
+  if (builder->has_rgb)
+    offset += snprintf(params + offset, sizeof(params) - offset,
+                       "\"r\":%d,\"g\":%d,\"b\":%d,", builder->rgb.r,
+                       builder->rgb.g, builder->rgb.b);
+  if (builder->has_temp)
+    offset += snprintf(params + offset, sizeof(params) - offset,
+                       "\"temp\":%d,", builder->temp);
+  if (builder->has_scene_id)
+    offset += snprintf(params + offset, sizeof(params) - offset,
+                       "\"sceneId\":%d,", builder->scene_id);
+  if (builder->has_speed)
+    offset += snprintf(params + offset, sizeof(params) - offset,
+                       "\"speed\":%d,", builder->speed);
+
+  if (offset > 1 && params[offset - 1] == ',')
+    offset--;
+  params[offset++] = '}';
+  params[offset] = '\0';
+
+  int len = snprintf(message, size, "{\"id\":%u,\"method\":\"%s\",\"params\":%s}",
+                     id, "setPilot", params);
+  return (int)strlen(message) == len ? len : -1;
+}
+
+static double elapsed_ns(struct timespec start, struct timespec end) {
+  return (double)(end.tv_sec - start.tv_sec) * 1e9 +
+         (double)(end.tv_nsec - start.tv_nsec);
+}
+
+// strip the leading {"id":N, so both outputs can be compared
+static const char *skip_id(const char *message) {
+  const char *comma = strchr(message, ',');
+  return comma ? comma + 1 : message;
+}
+
+static int run_case(const char *name, const wiz_pilot_builder_t *builder) {
+  char legacy[512];
+  char fast[256];
+  volatile int sink = 0;
+  struct timespec start, end;
+
+  legacy_build(legacy, sizeof(legacy), builder, 1);
+  wiz_build_pilot_message(fast, sizeof(fast), builder, NULL);
+  if (strcmp(skip_id(legacy), skip_id(fast)) != 0) {
+    fprintf(stderr, "%s: output differs\n  legacy: %s\n  writer: %s\n", name,
+            legacy, fast);
+    return 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < ITERATIONS; i++)
+    sink += legacy_build(legacy, sizeof(legacy), builder, (unsigned int)i);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double legacy_ns = elapsed_ns(start, end) / ITERATIONS;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < ITERATIONS; i++)
+    sink += wiz_build_pilot_message(fast, sizeof(fast), builder, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double fast_ns = elapsed_ns(start, end) / ITERATIONS;
+
+  (void)sink;
+  printf("%-12s %8.1f ns/cmd  %8.1f ns/cmd  %5.1fx\n", name, legacy_ns, fast_ns,
+         legacy_ns / fast_ns);
+  return 0;
+}
+
+int main(void) {
+  wiz_pilot_builder_t state = {0};
+  wiz_pilot_builder_set_state(&state, true);
+
+  wiz_pilot_builder_t rgb = {0};
+  wiz_pilot_builder_set_rgb(&rgb, 255, 128, 7);
+
+  wiz_pilot_builder_t full = {0};
+  wiz_pilot_builder_set_state(&full, true);
+  wiz_pilot_builder_set_brightness(&full, 75);
+  wiz_pilot_builder_set_rgb(&full, 128, 0, 255);
+  wiz_pilot_builder_set_scene(&full, 31);
+  full.has_speed = true;
+  full.speed = 150;
+
+  printf("setPilot serialization (%d iterations)\n", ITERATIONS);
+  printf("%-12s %16s  %16s  %6s\n", "case", "snprintf", "writer", "speedup");
+
+  int failed = 0;
+  failed |= run_case("state", &state);
+  failed |= run_case("rgb", &rgb);
+  failed |= run_case("all fields", &full);
+
+  return failed;
+}
@@ -1,10 +1,17 @@
 // Discovers all WiZ bulbs on the local network using UDP broadcast.
-// Currently non-functional.
 
 #include "cwiz.h"
 #include <stdio.h>
 #include <stdlib.h>
 
+static void on_found(const wiz_discovered_bulb_t *bulb, void *user_data) {
+  int *index = (int *)user_data;
+  printf("Bulb #%d:\n", ++*index);
+  printf("  IP Address:  %s\n", bulb->ip_address);
+  printf("  MAC Address: %s\n", bulb->mac_address);
+  printf("\n");
+}
+
 int main(int argc, char *argv[]) {
   const char *broadcast_addr = "255.255.255.255";
   int timeout = 5;
@@ -33,8 +40,10 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  // discover bulbs
-  int count = wiz_discover_bulbs(registry, broadcast_addr, timeout);
+  // discover bulbs on every interface, printing each one as it answers
+  int index = 0;
+  int count = wiz_discover_bulbs_ex(registry, broadcast_addr, timeout * 1000,
+                                    on_found, &index);
 
   if (count < 0) {
     fprintf(stderr, "Error during discovery: %s\n", wiz_strerror(count));
@@ -42,21 +51,7 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  printf("Found %d bulb(s):\n\n", count);
-
-  // Print discovered bulbs
-  wiz_discovered_bulb_t *bulb = registry->bulbs;
-  int index = 1;
-
-  while (bulb) {
-    printf("Bulb #%d:\n", index);
-    printf("  IP Address:  %s\n", bulb->ip_address);
-    printf("  MAC Address: %s\n", bulb->mac_address);
-    printf("\n");
-
-    bulb = bulb->next;
-    index++;
-  }
+  printf("Found %d bulb(s)\n", count);
 
   // clean up
   wiz_bulb_registry_destroy(registry);
@@ -0,0 +1,83 @@
+// Drives several bulbs concurrently from one thread using a fleet.
+
+#include "cwiz.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static void on_done(wiz_bulb_t *bulb, int result, const wiz_bulb_state_t *state,
+                    void *user_data) {
+  (void)user_data;
+  if (result == WIZ_OK) {
+    printf("  %-15s ok   (brightness %d, RGB %d,%d,%d)\n", bulb->ip_address,
+           state->brightness, state->rgb.r, state->rgb.g, state->rgb.b);
+  } else {
+    printf("  %-15s %s\n", bulb->ip_address, wiz_strerror(result));
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    printf("Usage: %s <bulb_ip_address> [bulb_ip_address ...]\n", argv[0]);
+    printf("Example: %s 192.168.1.100 192.168.1.101\n", argv[0]);
+    return 1;
+  }
+
+  int count = argc - 1;
+
+  printf("cwiz Example - Fleet Control\n");
+  printf("==================================\n\n");
+
+  // all bulbs share one socket owned by the fleet
+  wiz_fleet_t *fleet = wiz_fleet_create_pool(1);
+  if (!fleet) {
+    fprintf(stderr, "Error: Failed to create fleet\n");
+    return 1;
+  }
+
+  wiz_bulb_t **bulbs = (wiz_bulb_t **)calloc(count, sizeof(wiz_bulb_t *));
+  if (!bulbs) {
+    wiz_fleet_destroy(fleet);
+    return 1;
+  }
+
+  for (int i = 0; i < count; i++) {
+    bulbs[i] = wiz_bulb_create_shared(fleet, argv[i + 1]);
+    if (!bulbs[i]) {
+      fprintf(stderr, "Error: Failed to create bulb connection to %s\n",
+              argv[i + 1]);
+    }
+  }
+
+  // one builder, applied to every bulb at once
+  wiz_pilot_builder_t *builder = wiz_pilot_builder_create();
+  wiz_pilot_builder_set_state(builder, true);
+  wiz_pilot_builder_set_brightness(builder, 60);
+  wiz_pilot_builder_set_rgb(builder, 255, 120, 0);
+
+  printf("Setting all bulbs to orange at 60%%...\n");
+  for (int i = 0; i < count; i++) {
+    if (bulbs[i])
+      wiz_fleet_apply_pilot(fleet, bulbs[i], builder, on_done, NULL);
+  }
+  int ret = wiz_fleet_run(fleet);
+  if (ret != WIZ_OK) {
+    fprintf(stderr, "Error running fleet: %s\n", wiz_strerror(ret));
+  }
+  wiz_pilot_builder_destroy(builder);
+
+  printf("\nQuerying state of all bulbs...\n");
+  for (int i = 0; i < count; i++) {
+    if (bulbs[i])
+      wiz_fleet_update_state(fleet, bulbs[i], on_done, NULL);
+  }
+  wiz_fleet_run(fleet);
+
+  // clean up
+  for (int i = 0; i < count; i++)
+    wiz_bulb_destroy(bulbs[i]);
+  free(bulbs);
+  wiz_fleet_destroy(fleet);
+  printf("\nExample complete!\n");
+
+  return 0;
+}
@@ -0,0 +1,69 @@
+// Tracks bulb state from the pushes bulbs send to registered clients,
+// without polling.
+
+#include "cwiz.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static void on_push(wiz_bulb_t *bulb, const wiz_bulb_state_t *state,
+                    void *user_data) {
+  (void)user_data;
+  printf("  %-15s %s, brightness %d, scene %d\n", bulb->ip_address,
+         state->state ? "on " : "off", state->brightness, state->scene_id);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    printf("Usage: %s <bulb_ip_address> [bulb_ip_address ...]\n", argv[0]);
+    printf("Example: %s 192.168.1.100 192.168.1.101\n", argv[0]);
+    return 1;
+  }
+
+  int count = argc - 1;
+
+  printf("cwiz Example - Push Updates\n");
+  printf("==================================\n\n");
+
+  // advertise the first non-loopback address to the bulbs
+  wiz_listener_t *listener = wiz_listener_create(NULL, on_push, NULL);
+  if (!listener) {
+    fprintf(stderr, "Error: Failed to listen on port %d\n", WIZ_PUSH_PORT);
+    return 1;
+  }
+
+  wiz_bulb_t **bulbs = (wiz_bulb_t **)calloc(count, sizeof(wiz_bulb_t *));
+  if (!bulbs) {
+    wiz_listener_destroy(listener);
+    return 1;
+  }
+
+  for (int i = 0; i < count; i++) {
+    bulbs[i] = wiz_bulb_create(argv[i + 1]);
+    if (!bulbs[i]) {
+      fprintf(stderr, "Error: Failed to create bulb connection to %s\n",
+              argv[i + 1]);
+      continue;
+    }
+    wiz_listener_add(listener, bulbs[i]);
+  }
+
+  printf("Listening for state changes for 60 seconds...\n");
+  for (int second = 0; second < 60; second++) {
+    int ret = wiz_listener_poll(listener, 1000);
+    if (ret < 0) {
+      fprintf(stderr, "Error: %s\n", wiz_strerror(ret));
+      break;
+    }
+  }
+  printf("\n%d of %d bulb(s) registered\n", wiz_listener_registered(listener),
+         count);
+
+  // clean up
+  wiz_listener_destroy(listener);
+  for (int i = 0; i < count; i++)
+    wiz_bulb_destroy(bulbs[i]);
+  free(bulbs);
+  printf("\nExample complete!\n");
+
+  return 0;
+}
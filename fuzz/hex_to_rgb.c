@@ -0,0 +1,27 @@
+// libFuzzer entry point for hex color parsing: whatever parses must format
+// back to the same six digits.
+
+#include "cwiz.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  char *hex = malloc(size + 1);
+  if (!hex)
+    return 0;
+  memcpy(hex, data, size);
+  hex[size] = '\0';
+
+  wiz_rgb_t rgb;
+  if (wiz_hex_to_rgb(hex, &rgb) == WIZ_OK) {
+    char back[8];
+    snprintf(back, sizeof(back), "%02x%02x%02x", rgb.r, rgb.g, rgb.b);
+    if (strcasecmp(back, hex[0] == '#' ? hex + 1 : hex) != 0)
+      abort();
+  }
+
+  free(hex);
+  return 0;
+}
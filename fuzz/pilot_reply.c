@@ -0,0 +1,51 @@
+// libFuzzer entry point for the getPilot/syncPilot reply parser. A reply
+// that fails to parse must leave the state and info untouched, and one that
+// parses must leave every string terminated inside its field.
+
+#include "cwiz.h"
+#include <stdlib.h>
+#include <string.h>
+
+extern int wiz_parse_pilot_reply(const char *json, wiz_bulb_state_t *state,
+                                 wiz_bulb_info_t *info);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  char *json = malloc(size + 1);
+  if (!json)
+    return 0;
+  memcpy(json, data, size);
+  json[size] = '\0';
+
+  wiz_bulb_state_t state, before_state;
+  wiz_bulb_info_t info, before_info;
+  memset(&state, 0xa5, sizeof(state));
+  memset(&info, 0xa5, sizeof(info));
+  info.mac_address[0] = '\0';
+  info.module_name[0] = '\0';
+  info.firmware_version[0] = '\0';
+  info.home_id[0] = '\0';
+  info.room_id[0] = '\0';
+  before_state = state;
+  before_info = info;
+
+  int ret = wiz_parse_pilot_reply(json, &state, &info);
+  if (ret != WIZ_OK) {
+    if (memcmp(&state, &before_state, sizeof(state)) != 0 ||
+        memcmp(&info, &before_info, sizeof(info)) != 0)
+      abort();
+  } else if (strnlen(info.mac_address, sizeof(info.mac_address)) ==
+                 sizeof(info.mac_address) ||
+             strnlen(info.module_name, sizeof(info.module_name)) ==
+                 sizeof(info.module_name) ||
+             strnlen(info.firmware_version, sizeof(info.firmware_version)) ==
+                 sizeof(info.firmware_version) ||
+             strnlen(info.home_id, sizeof(info.home_id)) ==
+                 sizeof(info.home_id) ||
+             strnlen(info.room_id, sizeof(info.room_id)) ==
+                 sizeof(info.room_id)) {
+    abort();
+  }
+
+  free(json);
+  return 0;
+}
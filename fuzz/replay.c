@@ -0,0 +1,41 @@
+// Standalone driver for the fuzz entry points, for compilers without
+// libFuzzer: runs each file named on the command line through the target
+// once, so the corpus doubles as a regression suite.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    FILE *file = fopen(argv[i], "rb");
+    if (!file) {
+      perror(argv[i]);
+      return 1;
+    }
+
+    uint8_t *data = NULL;
+    size_t size = 0, capacity = 0, n;
+    do {
+      if (size == capacity) {
+        capacity = capacity ? capacity * 2 : 4096;
+        uint8_t *grown = realloc(data, capacity);
+        if (!grown) {
+          free(data);
+          fclose(file);
+          return 1;
+        }
+        data = grown;
+      }
+      n = fread(data + size, 1, capacity - size, file);
+      size += n;
+    } while (n > 0);
+    fclose(file);
+
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+  }
+  return 0;
+}
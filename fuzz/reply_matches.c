@@ -0,0 +1,32 @@
+// libFuzzer entry point for request/reply matching. The input is a request
+// and a response separated by the first newline; without one, the input is
+// matched against itself. Matching must not depend on argument order.
+
+#include "cwiz.h"
+#include <stdlib.h>
+#include <string.h>
+
+extern int wiz_reply_matches(const char *request, const char *response);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  char *input = malloc(size + 1);
+  if (!input)
+    return 0;
+  memcpy(input, data, size);
+  input[size] = '\0';
+
+  const char *request = input;
+  const char *response = input;
+  char *newline = memchr(input, '\n', size);
+  if (newline) {
+    *newline = '\0';
+    response = newline + 1;
+  }
+
+  if (wiz_reply_matches(request, response) !=
+      wiz_reply_matches(response, request))
+    abort();
+
+  free(input);
+  return 0;
+}
@@ -0,0 +1,42 @@
+// libFuzzer entry point for the getSystemConfig reply parser. A reply that
+// fails to parse must leave the info untouched, and one that parses must
+// leave every string terminated inside its field.
+
+#include "cwiz.h"
+#include <stdlib.h>
+#include <string.h>
+
+extern int wiz_parse_system_config(const char *json, wiz_bulb_info_t *info);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  char *json = malloc(size + 1);
+  if (!json)
+    return 0;
+  memcpy(json, data, size);
+  json[size] = '\0';
+
+  wiz_bulb_info_t info, before;
+  memset(&info, 0, sizeof(info));
+  strcpy(info.mac_address, "000000000000");
+  before = info;
+
+  int ret = wiz_parse_system_config(json, &info);
+  if (ret != WIZ_OK) {
+    if (memcmp(&info, &before, sizeof(info)) != 0)
+      abort();
+  } else if (strnlen(info.mac_address, sizeof(info.mac_address)) ==
+                 sizeof(info.mac_address) ||
+             strnlen(info.module_name, sizeof(info.module_name)) ==
+                 sizeof(info.module_name) ||
+             strnlen(info.firmware_version, sizeof(info.firmware_version)) ==
+                 sizeof(info.firmware_version) ||
+             strnlen(info.home_id, sizeof(info.home_id)) ==
+                 sizeof(info.home_id) ||
+             strnlen(info.room_id, sizeof(info.room_id)) ==
+                 sizeof(info.room_id)) {
+    abort();
+  }
+
+  free(json);
+  return 0;
+}
@@ -12,6 +12,12 @@
 #define WIZ_MAX_RETRIES 6
 #define WIZ_TEMP_MIN 2200
 #define WIZ_TEMP_MAX 6500
+#define WIZ_FLEET_MAX_SOCKETS 16
+#define WIZ_RTO_MIN_MS 50
+#define WIZ_DISCOVERY_MAX_TARGETS 16
+#define WIZ_PUSH_PORT 38900
+#define WIZ_REGISTER_INTERVAL_MS 20000
+#define WIZ_RTT_BUCKETS 16
 
 // error codes
 typedef enum {
@@ -22,13 +28,20 @@ typedef enum {
   WIZ_ERR_JSON_PARSE = -4,
   WIZ_ERR_NO_RESPONSE = -5,
   WIZ_ERR_MALLOC = -6,
-  WIZ_ERR_CONNECTION = -7
+  WIZ_ERR_CONNECTION = -7,
+  WIZ_ERR_IO = -8,
+  WIZ_ERR_FORMAT = -9
 } wiz_error_t;
 
 typedef struct wiz_bulb wiz_bulb_t;
 typedef struct wiz_pilot_builder wiz_pilot_builder_t;
 typedef struct wiz_discovered_bulb wiz_discovered_bulb_t;
 typedef struct wiz_bulb_registry wiz_bulb_registry_t;
+typedef struct wiz_fleet wiz_fleet_t;
+typedef struct wiz_listener wiz_listener_t;
+typedef struct wiz_io wiz_io_t;
+typedef struct wiz_group wiz_group_t;
+typedef struct wiz_pilot_message wiz_pilot_message_t;
 
 // color representations
 typedef struct {
@@ -67,6 +80,112 @@ typedef struct {
   char room_id[64];
 } wiz_bulb_info_t;
 
+// completion callback for fleet requests; state is the bulb's cached state
+// after the reply (or the unchanged cache on failure)
+typedef void (*wiz_callback_t)(wiz_bulb_t *bulb, int result,
+                               const wiz_bulb_state_t *state, void *user_data);
+
+// called after a syncPilot push has been applied to the bulb's cached state
+typedef void (*wiz_push_callback_t)(wiz_bulb_t *bulb,
+                                    const wiz_bulb_state_t *state,
+                                    void *user_data);
+
+// late or misdirected datagrams dropped while waiting for a reply
+typedef struct {
+  uint32_t stale_replies;   // from the bulb, but not answering this request
+  uint32_t foreign_replies; // from some other address
+} wiz_reply_stats_t;
+
+// state fields tracked by the freshness cache, as bit masks
+typedef enum {
+  WIZ_FIELD_STATE = 1 << 0,
+  WIZ_FIELD_BRIGHTNESS = 1 << 1,
+  WIZ_FIELD_RGB = 1 << 2,
+  WIZ_FIELD_TEMP = 1 << 3,
+  WIZ_FIELD_SCENE = 1 << 4,
+  WIZ_FIELD_SPEED = 1 << 5
+} wiz_field_t;
+
+#define WIZ_FIELD_COUNT 6
+#define WIZ_FIELD_ALL ((1 << WIZ_FIELD_COUNT) - 1)
+
+// what last confirmed a cached field
+typedef enum {
+  WIZ_SOURCE_NONE = 0,
+  WIZ_SOURCE_ACK,  // a setPilot we sent was acknowledged
+  WIZ_SOURCE_POLL, // a getPilot reply
+  WIZ_SOURCE_PUSH  // a syncPilot push
+} wiz_source_t;
+
+// per-field confirmation times on the monotonic clock, indexed by the bit
+// position of the wiz_field_t; 0 means never confirmed
+typedef struct {
+  uint64_t confirmed_ms[WIZ_FIELD_COUNT];
+  uint8_t source[WIZ_FIELD_COUNT]; // wiz_source_t
+} wiz_freshness_t;
+
+// round-trip estimator (Jacobson/Karels); srtt is scaled by 8 and rttvar
+// by 4 as in RFC 6298, all in milliseconds
+typedef struct {
+  uint32_t srtt;
+  uint32_t rttvar;
+  uint32_t samples; // 0 until the first clean round trip
+} wiz_rtt_t;
+
+// transport counters for request/reply exchanges, per bulb and process-wide.
+// retransmits[n] counts sends of attempt n (retransmits[0] is unused);
+// rtt_buckets[i] counts clean round trips of at most 2^i ms, the last bucket
+// everything slower
+typedef struct {
+  uint64_t requests;
+  uint64_t retransmits[WIZ_MAX_RETRIES];
+  uint64_t replies; // exchanges answered, whether or not the reply parsed
+  uint64_t timeouts;
+  uint64_t send_errors;
+  uint64_t stale_replies;
+  uint64_t foreign_replies;
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  uint64_t rtt_buckets[WIZ_RTT_BUCKETS];
+  uint64_t rtt_count;
+  uint64_t rtt_sum_ms;
+  uint32_t srtt_ms; // current smoothed estimate, per bulb only
+} wiz_metrics_t;
+
+// transport events reported to the trace callback
+typedef enum {
+  WIZ_TRACE_SEND,       // first transmission of a request
+  WIZ_TRACE_RETRANSMIT, // a later attempt of the same request
+  WIZ_TRACE_RECEIVE,    // a datagram from the peer arrived
+  WIZ_TRACE_PARSE,      // the datagram was parsed and matched (or not)
+  WIZ_TRACE_TIMEOUT     // an attempt's wait ran out
+} wiz_trace_kind_t;
+
+// result is the byte count for SEND, RETRANSMIT and RECEIVE, the parse
+// result for PARSE (WIZ_ERR_JSON_PARSE for a reply to some other request),
+// and WIZ_ERR_TIMEOUT for TIMEOUT. addr is the bulb, or the broadcast target during discovery.
+typedef struct {
+  wiz_trace_kind_t kind;
+  uint64_t time_ns; // CLOCK_MONOTONIC
+  struct sockaddr_in addr;
+  char method[24]; // empty when the datagram names none
+  int attempt;
+  int result;
+} wiz_trace_event_t;
+
+typedef void (*wiz_trace_callback_t)(const wiz_trace_event_t *event,
+                                     void *user_data);
+
+// unacknowledged streaming counters
+typedef struct {
+  uint32_t frames;  // frames handed to the kernel
+  uint32_t dropped; // frames skipped because the socket buffer was full
+  uint32_t acks;    // acknowledgements seen
+  uint64_t last_ack_ms;
+  int sample_id; // id of the frame being timed, -1 when none
+  uint64_t sample_sent_ms;
+} wiz_stream_stats_t;
+
 // scenes
 typedef struct {
   uint16_t id;
@@ -76,13 +195,24 @@ typedef struct {
 struct wiz_discovered_bulb {
   char ip_address[16];
   char mac_address[18];
+  char module_name[64];      // empty until known
+  char firmware_version[32]; // empty until known
+  int64_t last_seen;         // unix time of the last reply, 0 if never
   struct wiz_discovered_bulb *next;
 };
 
+// called once for each bulb seen for the first time during discovery
+typedef void (*wiz_discovery_callback_t)(const wiz_discovered_bulb_t *bulb,
+                                         void *user_data);
+
 // registry
+// bulbs/next list the entries in discovery order. An entry never moves once
+// added, so pointers from lookups, the list and the discovery callback stay
+// valid until the registry is destroyed.
 struct wiz_bulb_registry {
   wiz_discovered_bulb_t *bulbs;
   int count;
+  struct wiz_registry_index *index; // storage and lookups, library-private
 };
 
 // main structure
@@ -93,6 +223,15 @@ struct wiz_bulb {
   struct sockaddr_in addr;
   wiz_bulb_state_t state;
   wiz_bulb_info_t info;
+  wiz_fleet_t *fleet; // owner of socket_fd when shared, NULL otherwise
+  uint32_t watched_by; // id of the last fleet that added socket_fd to epoll
+  wiz_reply_stats_t replies;
+  bool echoes_id; // has answered with our id; id-less replies are now strays
+  wiz_rtt_t rtt;
+  wiz_stream_stats_t stream;
+  wiz_freshness_t freshness;
+  wiz_metrics_t metrics;
+  struct wiz_snapshot *snapshot; // seqlock copy of state, threaded mode only
 };
 
 struct wiz_pilot_builder {
@@ -112,6 +251,7 @@ struct wiz_pilot_builder {
 
 // bulb control functions
 wiz_bulb_t *wiz_bulb_create(const char *ip_address);
+wiz_bulb_t *wiz_bulb_create_shared(wiz_fleet_t *fleet, const char *ip_address);
 void wiz_bulb_destroy(wiz_bulb_t *bulb);
 int wiz_bulb_turn_on(wiz_bulb_t *bulb);
 int wiz_bulb_turn_off(wiz_bulb_t *bulb);
@@ -123,6 +263,21 @@ int wiz_bulb_update_state(wiz_bulb_t *bulb);
 int wiz_bulb_get_state(wiz_bulb_t *bulb, wiz_bulb_state_t *state);
 int wiz_bulb_apply_pilot(wiz_bulb_t *bulb, wiz_pilot_builder_t *builder);
 
+// freshness-aware reads: the age is that of the oldest of the given fields
+// (-1 if one was never confirmed); the fresh read only goes to the network
+// when the cached state is older than max_age_ms
+int64_t wiz_bulb_state_age(const wiz_bulb_t *bulb, unsigned int fields);
+int wiz_bulb_get_state_fresh(wiz_bulb_t *bulb, int max_age_ms,
+                             wiz_bulb_state_t *state);
+
+// streaming functions: fire-and-forget frames for high-rate effects; acks are
+// only sampled for liveness and RTT, and frames are never retransmitted. A
+// bulb on a fleet's shared socket streams unsampled: its acks reach the fleet,
+// which drops them, and wiz_bulb_stream_poll() always returns 0.
+int wiz_bulb_stream_pilot(wiz_bulb_t *bulb, const wiz_pilot_builder_t *builder);
+int wiz_bulb_stream_rgb(wiz_bulb_t *bulb, uint8_t r, uint8_t g, uint8_t b);
+int wiz_bulb_stream_poll(wiz_bulb_t *bulb);
+
 // pilot builder functions
 wiz_pilot_builder_t *wiz_pilot_builder_create(void);
 void wiz_pilot_builder_destroy(wiz_pilot_builder_t *builder);
@@ -136,14 +291,156 @@ void wiz_pilot_builder_set_temperature(wiz_pilot_builder_t *builder,
 void wiz_pilot_builder_set_scene(wiz_pilot_builder_t *builder,
                                  uint16_t scene_id);
 
+// compiled pilots: a builder frozen into its finished setPilot datagram, for
+// presets sent over and over. The message is immutable and may be kept,
+// shared between threads and sent to any number of bulbs; sending formats
+// nothing, it copies the datagram and stamps a fresh request id into it. An
+// ack commits the fields recorded at compile time to the bulb's state.
+// Destroying a message that is still queued on a fleet is safe.
+wiz_pilot_message_t *wiz_pilot_builder_compile(const wiz_pilot_builder_t *builder);
+void wiz_pilot_message_destroy(wiz_pilot_message_t *message);
+const char *wiz_pilot_message_data(const wiz_pilot_message_t *message,
+                                   size_t *length);
+unsigned int wiz_pilot_message_fields(const wiz_pilot_message_t *message);
+int wiz_bulb_send_pilot(wiz_bulb_t *bulb, const wiz_pilot_message_t *message);
+
+// fleet functions: many requests in flight from one thread, each bulb keeps
+// its own retry schedule and replies are matched by source address
+wiz_fleet_t *wiz_fleet_create(void);
+wiz_fleet_t *wiz_fleet_create_pool(int socket_count);
+void wiz_fleet_destroy(wiz_fleet_t *fleet);
+int wiz_fleet_apply_pilot(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                          const wiz_pilot_builder_t *builder,
+                          wiz_callback_t callback, void *user_data);
+int wiz_fleet_update_state(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                           wiz_callback_t callback, void *user_data);
+int wiz_fleet_send_pilot(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                         const wiz_pilot_message_t *message,
+                         wiz_callback_t callback, void *user_data);
+int wiz_fleet_apply_pilot_many(wiz_fleet_t *fleet, wiz_bulb_t **bulbs,
+                               int count, const wiz_pilot_builder_t *builder,
+                               wiz_callback_t callback, void *user_data);
+int wiz_fleet_poll_state(wiz_fleet_t *fleet, wiz_bulb_t **bulbs, int count,
+                         int window, int timeout_ms, wiz_callback_t callback,
+                         void *user_data);
+int wiz_fleet_pending(wiz_fleet_t *fleet);
+int wiz_fleet_poll(wiz_fleet_t *fleet, int timeout_ms);
+int wiz_fleet_run(wiz_fleet_t *fleet);
+
+// event loop integration: watch the fd for readability, arm a timer for
+// wiz_fleet_next_timeout() ms, and call wiz_process_events() on either
+int wiz_fleet_get_fd(wiz_fleet_t *fleet);
+int wiz_fleet_next_timeout(wiz_fleet_t *fleet);
+int wiz_process_events(wiz_fleet_t *fleet);
+
+// push listener: registers with bulbs, keeps the registrations alive and
+// applies the syncPilot pushes they send to WIZ_PUSH_PORT
+wiz_listener_t *wiz_listener_create(const char *local_ip,
+                                    wiz_push_callback_t callback,
+                                    void *user_data);
+void wiz_listener_destroy(wiz_listener_t *listener);
+int wiz_listener_add(wiz_listener_t *listener, wiz_bulb_t *bulb);
+int wiz_listener_remove(wiz_listener_t *listener, wiz_bulb_t *bulb);
+int wiz_listener_registered(wiz_listener_t *listener);
+int wiz_listener_get_fd(wiz_listener_t *listener);
+int wiz_listener_next_timeout(wiz_listener_t *listener);
+int wiz_listener_process(wiz_listener_t *listener);
+int wiz_listener_poll(wiz_listener_t *listener, int timeout_ms);
+
+// threaded mode: one I/O thread owns the sockets. The submit and
+// wiz_io_get_state() calls are safe from any thread; callbacks run on the I/O
+// thread. Blocking bulb calls must not be used on these bulbs.
+wiz_io_t *wiz_io_create(int socket_count);
+void wiz_io_destroy(wiz_io_t *io);
+wiz_bulb_t *wiz_io_bulb_create(wiz_io_t *io, const char *ip_address);
+int wiz_io_apply_pilot(wiz_io_t *io, wiz_bulb_t *bulb,
+                       const wiz_pilot_builder_t *builder,
+                       wiz_callback_t callback, void *user_data);
+int wiz_io_update_state(wiz_io_t *io, wiz_bulb_t *bulb,
+                        wiz_callback_t callback, void *user_data);
+int wiz_io_get_state(const wiz_bulb_t *bulb, wiz_bulb_state_t *state);
+
+// non-blocking bulb functions; they return once the request is queued and
+// report through the callback from wiz_process_events()
+int wiz_bulb_turn_on_async(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                           wiz_callback_t callback, void *user_data);
+int wiz_bulb_turn_off_async(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                            wiz_callback_t callback, void *user_data);
+int wiz_bulb_set_brightness_async(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                                  uint8_t brightness, wiz_callback_t callback,
+                                  void *user_data);
+int wiz_bulb_set_rgb_async(wiz_fleet_t *fleet, wiz_bulb_t *bulb, uint8_t r,
+                           uint8_t g, uint8_t b, wiz_callback_t callback,
+                           void *user_data);
+int wiz_bulb_set_temperature_async(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                                   uint16_t temp, wiz_callback_t callback,
+                                   void *user_data);
+int wiz_bulb_set_scene_async(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                             uint16_t scene_id, wiz_callback_t callback,
+                             void *user_data);
+int wiz_bulb_update_state_async(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                                wiz_callback_t callback, void *user_data);
+int wiz_bulb_apply_pilot_async(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                               wiz_pilot_builder_t *builder,
+                               wiz_callback_t callback, void *user_data);
+int wiz_bulb_send_pilot_async(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                              const wiz_pilot_message_t *message,
+                              wiz_callback_t callback, void *user_data);
+
+// groups: bulbs that take the same command. A group apply serializes the
+// builder once, sends that one immutable payload to every member through a
+// fleet and commits the fields to each member that acked. Membership cannot
+// change while an apply is in flight. The blocking call runs on the fleet
+// whose shared socket the members were created from, or on a fleet of the
+// group's own; members from two different fleets give WIZ_ERR_INVALID_PARAM.
+// wiz_group_result() is WIZ_ERR_NO_RESPONSE until an apply reaches a member.
+wiz_group_t *wiz_group_create(void);
+void wiz_group_destroy(wiz_group_t *group);
+int wiz_group_add(wiz_group_t *group, wiz_bulb_t *bulb);
+int wiz_group_remove(wiz_group_t *group, wiz_bulb_t *bulb);
+int wiz_group_count(const wiz_group_t *group);
+wiz_bulb_t *wiz_group_get(const wiz_group_t *group, int index);
+int wiz_group_result(const wiz_group_t *group, int index);
+int wiz_group_apply_pilot(wiz_group_t *group,
+                          const wiz_pilot_builder_t *builder);
+int wiz_group_apply_pilot_async(wiz_fleet_t *fleet, wiz_group_t *group,
+                                const wiz_pilot_builder_t *builder,
+                                wiz_callback_t callback, void *user_data);
+int wiz_group_send_pilot(wiz_group_t *group,
+                         const wiz_pilot_message_t *message);
+int wiz_group_send_pilot_async(wiz_fleet_t *fleet, wiz_group_t *group,
+                               const wiz_pilot_message_t *message,
+                               wiz_callback_t callback, void *user_data);
+
 // discovery and registry functions
 wiz_bulb_registry_t *wiz_bulb_registry_create(void);
 void wiz_bulb_registry_destroy(wiz_bulb_registry_t *registry);
 int wiz_discover_bulbs(wiz_bulb_registry_t *registry,
                        const char *broadcast_address, int timeout);
+int wiz_discover_bulbs_ex(wiz_bulb_registry_t *registry,
+                          const char *broadcast_address, int timeout_ms,
+                          wiz_discovery_callback_t callback, void *user_data);
 
 wiz_discovered_bulb_t *wiz_registry_get_by_mac(wiz_bulb_registry_t *registry,
                                                const char *mac_address);
+wiz_discovered_bulb_t *wiz_registry_get_by_ip(wiz_bulb_registry_t *registry,
+                                              const char *ip_address);
+int wiz_registry_save(const wiz_bulb_registry_t *registry, const char *path);
+int wiz_registry_load(wiz_bulb_registry_t *registry, const char *path);
+
+// metrics: per-bulb counters belong to the thread driving the bulb, the
+// process-wide totals may be read from any thread. The Prometheus writer
+// returns the full length like snprintf, so a short buffer can be retried.
+int wiz_bulb_get_metrics(const wiz_bulb_t *bulb, wiz_metrics_t *metrics);
+int wiz_metrics_get_global(wiz_metrics_t *metrics);
+int wiz_metrics_write_prometheus(char *buffer, size_t size,
+                                 wiz_bulb_t *const *bulbs, int count);
+
+// tracing: only a library built with `make TRACE=1` (CWIZ_TRACE) calls the
+// hook; otherwise the trace points compile to nothing. The callback runs on
+// the thread doing the I/O and must not block.
+bool wiz_trace_enabled(void);
+void wiz_trace_set_callback(wiz_trace_callback_t callback, void *user_data);
 
 // scene functions
 const char *wiz_get_scene_name(uint16_t scene_id);
@@ -7,27 +7,59 @@
 
 
 extern int wiz_create_socket(void);
-extern int wiz_send_receive(int sock, struct sockaddr_in *addr,
-                            const char *message, char *response,
-                            size_t response_size);
+extern int wiz_send_receive(wiz_bulb_t *bulb, const char *message,
+                            char *response, size_t response_size);
 extern int wiz_build_json_message(char *buffer, size_t size, const char *method,
                                   const char *params);
-extern int wiz_parse_get_pilot_response(const char *json,
-                                        wiz_bulb_state_t *state);
+extern int wiz_parse_pilot_reply(const char *json, wiz_bulb_state_t *state,
+                                 wiz_bulb_info_t *info);
 extern int wiz_parse_system_config(const char *json, wiz_bulb_info_t *info);
+extern int wiz_build_pilot_message(char *buffer, size_t size,
+                                   const wiz_pilot_builder_t *builder,
+                                   uint32_t *id);
+extern void wiz_pilot_builder_commit(const wiz_pilot_builder_t *builder,
+                                     wiz_bulb_state_t *state);
+extern unsigned int wiz_pilot_builder_fields(const wiz_pilot_builder_t *builder);
+extern void wiz_state_confirm(wiz_bulb_t *bulb, unsigned int fields,
+                              wiz_source_t source);
+extern const wiz_pilot_builder_t *
+wiz_pilot_message_builder(const wiz_pilot_message_t *message);
+extern uint32_t wiz_stamp_request_id(char *message);
+
+extern int wiz_fleet_shared_socket(wiz_fleet_t *fleet,
+                                   const struct sockaddr_in *addr);
+extern int wiz_fleet_exchange(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                              const char *message, char *response,
+                              size_t response_size);
+
+// internal helper to exchange one message, through the owning fleet when the
+// socket is shared so replies for other bulbs are not swallowed
+static int _wiz_exchange(wiz_bulb_t *bulb, const char *message, char *response,
+                         size_t response_size) {
+  if (bulb->fleet)
+    return wiz_fleet_exchange(bulb->fleet, bulb, message, response,
+                              response_size);
+
+  return wiz_send_receive(bulb, message, response, response_size);
+}
 
-// internal helper to send parameter update
-static int _wiz_send_param(wiz_bulb_t *bulb, const char *method, const char *params) {
+// internal helper to send a setPilot update
+static int _wiz_send_pilot(wiz_bulb_t *bulb, const wiz_pilot_builder_t *builder) {
   char message[256];
   char response[1024];
 
-  int ret = wiz_build_json_message(message, sizeof(message), method, params);
-  if (ret != WIZ_OK) return ret;
+  int ret = wiz_build_pilot_message(message, sizeof(message), builder, NULL);
+  if (ret < 0) return ret;
 
-  return wiz_send_receive(bulb->socket_fd, &bulb->addr, message, response, sizeof(response));
+  ret = _wiz_exchange(bulb, message, response, sizeof(response));
+  if (ret == WIZ_OK)
+    wiz_state_confirm(bulb, wiz_pilot_builder_fields(builder),
+                      WIZ_SOURCE_ACK);
+  return ret;
 }
 
-wiz_bulb_t *wiz_bulb_create(const char *ip_address) {
+// internal helper to allocate a bulb and resolve its address
+static wiz_bulb_t *_wiz_bulb_alloc(const char *ip_address) {
   if (!ip_address) {
     return NULL;
   }
@@ -39,6 +71,26 @@ wiz_bulb_t *wiz_bulb_create(const char *ip_address) {
 
   strncpy(bulb->ip_address, ip_address, sizeof(bulb->ip_address) - 1);
   bulb->port = WIZ_PORT;
+  bulb->socket_fd = -1;
+  bulb->stream.sample_id = -1;
+
+  memset(&bulb->addr, 0, sizeof(bulb->addr));
+  bulb->addr.sin_family = AF_INET;
+  bulb->addr.sin_port = htons(bulb->port);
+
+  if (inet_pton(AF_INET, ip_address, &bulb->addr.sin_addr) <= 0) {
+    free(bulb);
+    return NULL;
+  }
+
+  return bulb;
+}
+
+wiz_bulb_t *wiz_bulb_create(const char *ip_address) {
+  wiz_bulb_t *bulb = _wiz_bulb_alloc(ip_address);
+  if (!bulb) {
+    return NULL;
+  }
 
   bulb->socket_fd = wiz_create_socket();
   if (bulb->socket_fd < 0) {
@@ -46,15 +98,26 @@ wiz_bulb_t *wiz_bulb_create(const char *ip_address) {
     return NULL;
   }
 
-  memset(&bulb->addr, 0, sizeof(bulb->addr));
-  bulb->addr.sin_family = AF_INET;
-  bulb->addr.sin_port = htons(bulb->port);
+  return bulb;
+}
 
-  if (inet_pton(AF_INET, ip_address, &bulb->addr.sin_addr) <= 0) {
-    close(bulb->socket_fd);
+// create a bulb that uses one of the fleet's pooled sockets instead of its own
+wiz_bulb_t *wiz_bulb_create_shared(wiz_fleet_t *fleet, const char *ip_address) {
+  if (!fleet) {
+    return NULL;
+  }
+
+  wiz_bulb_t *bulb = _wiz_bulb_alloc(ip_address);
+  if (!bulb) {
+    return NULL;
+  }
+
+  bulb->socket_fd = wiz_fleet_shared_socket(fleet, &bulb->addr);
+  if (bulb->socket_fd < 0) {
     free(bulb);
     return NULL;
   }
+  bulb->fleet = fleet;
 
   return bulb;
 }
@@ -63,17 +126,22 @@ void wiz_bulb_destroy(wiz_bulb_t *bulb) {
   if (!bulb)
     return;
 
-  if (bulb->socket_fd >= 0) {
+  // shared sockets belong to the fleet
+  if (!bulb->fleet && bulb->socket_fd >= 0) {
     close(bulb->socket_fd);
   }
 
+  free(bulb->snapshot);
   free(bulb);
 }
 
 int wiz_bulb_turn_on(wiz_bulb_t *bulb) {
   if (!bulb) return WIZ_ERR_INVALID_PARAM;
 
-  int ret = _wiz_send_param(bulb, "setPilot", "{\"state\":true}");
+  wiz_pilot_builder_t builder = {0};
+  wiz_pilot_builder_set_state(&builder, true);
+
+  int ret = _wiz_send_pilot(bulb, &builder);
   if (ret == WIZ_OK) {
     bulb->state.state = true;
   }
@@ -83,37 +151,44 @@ int wiz_bulb_turn_on(wiz_bulb_t *bulb) {
 int wiz_bulb_turn_off(wiz_bulb_t *bulb) {
   if (!bulb) return WIZ_ERR_INVALID_PARAM;
 
-  int ret = _wiz_send_param(bulb, "setPilot", "{\"state\":false}");
+  wiz_pilot_builder_t builder = {0};
+  wiz_pilot_builder_set_state(&builder, false);
+
+  int ret = _wiz_send_pilot(bulb, &builder);
   if (ret == WIZ_OK) {
     bulb->state.state = false;
   }
   return ret;
 }
 
+// setting brightness turns the bulb on, so state:true goes out with the
+// dimming; the blocking and async forms send the same datagram
+static void _brightness_pilot(wiz_pilot_builder_t *builder,
+                              uint8_t brightness) {
+  wiz_pilot_builder_set_brightness(builder, brightness);
+  wiz_pilot_builder_set_state(builder, true);
+}
+
 int wiz_bulb_set_brightness(wiz_bulb_t *bulb, uint8_t brightness) {
   if (!bulb) return WIZ_ERR_INVALID_PARAM;
 
-  if (brightness < 10) brightness = 10;
-  if (brightness > 100) brightness = 100;
-
-  char params[64];
-  snprintf(params, sizeof(params), "{\"dimming\":%d}", brightness);
+  wiz_pilot_builder_t builder = {0};
+  _brightness_pilot(&builder, brightness);
 
-  int ret = _wiz_send_param(bulb, "setPilot", params);
-  if (ret == WIZ_OK) {
-    bulb->state.brightness = brightness;
-    bulb->state.state = true; // setting brightness turns bulb on
-  }
+  // the cache takes exactly what was sent, clamped brightness included
+  int ret = _wiz_send_pilot(bulb, &builder);
+  if (ret == WIZ_OK)
+    wiz_pilot_builder_commit(&builder, &bulb->state);
   return ret;
 }
 
 int wiz_bulb_set_rgb(wiz_bulb_t *bulb, uint8_t r, uint8_t g, uint8_t b) {
   if (!bulb) return WIZ_ERR_INVALID_PARAM;
 
-  char params[128];
-  snprintf(params, sizeof(params), "{\"r\":%d,\"g\":%d,\"b\":%d}", r, g, b);
+  wiz_pilot_builder_t builder = {0};
+  wiz_pilot_builder_set_rgb(&builder, r, g, b);
 
-  int ret = _wiz_send_param(bulb, "setPilot", params);
+  int ret = _wiz_send_pilot(bulb, &builder);
   if (ret == WIZ_OK) {
     bulb->state.rgb.r = r;
     bulb->state.rgb.g = g;
@@ -128,10 +203,10 @@ int wiz_bulb_set_temperature(wiz_bulb_t *bulb, uint16_t temp) {
   if (temp < WIZ_TEMP_MIN) temp = WIZ_TEMP_MIN;
   if (temp > WIZ_TEMP_MAX) temp = WIZ_TEMP_MAX;
 
-  char params[64];
-  snprintf(params, sizeof(params), "{\"temp\":%d}", temp);
+  wiz_pilot_builder_t builder = {0};
+  wiz_pilot_builder_set_temperature(&builder, temp);
 
-  int ret = _wiz_send_param(bulb, "setPilot", params);
+  int ret = _wiz_send_pilot(bulb, &builder);
   if (ret == WIZ_OK) {
     bulb->state.temp = temp;
   }
@@ -141,10 +216,10 @@ int wiz_bulb_set_temperature(wiz_bulb_t *bulb, uint16_t temp) {
 int wiz_bulb_set_scene(wiz_bulb_t *bulb, uint16_t scene_id) {
   if (!bulb) return WIZ_ERR_INVALID_PARAM;
 
-  char params[64];
-  snprintf(params, sizeof(params), "{\"sceneId\":%d}", scene_id);
+  wiz_pilot_builder_t builder = {0};
+  wiz_pilot_builder_set_scene(&builder, scene_id);
 
-  int ret = _wiz_send_param(bulb, "setPilot", params);
+  int ret = _wiz_send_pilot(bulb, &builder);
   if (ret == WIZ_OK) {
     bulb->state.scene_id = scene_id;
   }
@@ -162,12 +237,14 @@ int wiz_bulb_update_state(wiz_bulb_t *bulb) {
   if (ret != WIZ_OK)
     return ret;
 
-  ret = wiz_send_receive(bulb->socket_fd, &bulb->addr, message, response,
-                         sizeof(response));
+  ret = _wiz_exchange(bulb, message, response, sizeof(response));
   if (ret != WIZ_OK)
     return ret;
 
-  return wiz_parse_get_pilot_response(response, &bulb->state);
+  ret = wiz_parse_pilot_reply(response, &bulb->state, &bulb->info);
+  if (ret == WIZ_OK)
+    wiz_state_confirm(bulb, WIZ_FIELD_ALL, WIZ_SOURCE_POLL);
+  return ret;
 }
 
 int wiz_bulb_get_state(wiz_bulb_t *bulb, wiz_bulb_state_t *state) {
@@ -182,62 +259,98 @@ int wiz_bulb_apply_pilot(wiz_bulb_t *bulb, wiz_pilot_builder_t *builder) {
   if (!bulb || !builder)
     return WIZ_ERR_INVALID_PARAM;
 
-  char message[512];
-  char params[384];
-  char response[1024];
-  int offset = 0;
-
-  offset = 1;
-  params[offset - 1] = '{';
-
-  if (builder->has_state)
-    offset += snprintf(params + offset, sizeof(params) - offset,
-                       "\"state\":%s,", builder->state ? "true" : "false");
-  if (builder->has_brightness)
-    offset += snprintf(params + offset, sizeof(params) - offset,
-                       "\"dimming\":%d,", builder->brightness);
-  if (builder->has_rgb)
-    offset += snprintf(params + offset, sizeof(params) - offset,
-                       "\"r\":%d,\"g\":%d,\"b\":%d,",
-                       builder->rgb.r, builder->rgb.g, builder->rgb.b);
-  if (builder->has_temp)
-    offset += snprintf(params + offset, sizeof(params) - offset,
-                       "\"temp\":%d,", builder->temp);
-  if (builder->has_scene_id)
-    offset += snprintf(params + offset, sizeof(params) - offset,
-                       "\"sceneId\":%d,", builder->scene_id);
-  if (builder->has_speed)
-    offset += snprintf(params + offset, sizeof(params) - offset,
-                       "\"speed\":%d,", builder->speed);
-
-  if (offset > 1 && params[offset - 1] == ',')
-    offset--;
-  params[offset++] = '}';
-  params[offset] = '\0';
-
-  int ret =
-      wiz_build_json_message(message, sizeof(message), "setPilot", params);
-  if (ret != WIZ_OK)
-    return ret;
-
-  ret = wiz_send_receive(bulb->socket_fd, &bulb->addr, message, response,
-                         sizeof(response));
+  int ret = _wiz_send_pilot(bulb, builder);
 
   // update local state if successful
+  if (ret == WIZ_OK)
+    wiz_pilot_builder_commit(builder, &bulb->state);
+
+  return ret;
+}
+
+// send a compiled pilot as is and commit its recorded fields on ack
+int wiz_bulb_send_pilot(wiz_bulb_t *bulb, const wiz_pilot_message_t *message) {
+  if (!bulb || !message)
+    return WIZ_ERR_INVALID_PARAM;
+
+  // a fresh id per send, so a late ack to an earlier send is not taken for
+  // this one
+  char request[256];
+  size_t length;
+  const char *data = wiz_pilot_message_data(message, &length);
+  memcpy(request, data, length + 1);
+  wiz_stamp_request_id(request);
+
+  char response[1024];
+  int ret = _wiz_exchange(bulb, request, response, sizeof(response));
   if (ret == WIZ_OK) {
-    if (builder->has_state)
-      bulb->state.state = builder->state;
-    if (builder->has_brightness)
-      bulb->state.brightness = builder->brightness;
-    if (builder->has_rgb)
-      bulb->state.rgb = builder->rgb;
-    if (builder->has_temp)
-      bulb->state.temp = builder->temp;
-    if (builder->has_scene_id)
-      bulb->state.scene_id = builder->scene_id;
-    if (builder->has_speed)
-      bulb->state.speed = builder->speed;
+    const wiz_pilot_builder_t *fields = wiz_pilot_message_builder(message);
+    wiz_state_confirm(bulb, wiz_pilot_message_fields(message), WIZ_SOURCE_ACK);
+    wiz_pilot_builder_commit(fields, &bulb->state);
   }
 
   return ret;
 }
+
+int wiz_bulb_turn_on_async(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                           wiz_callback_t callback, void *user_data) {
+  wiz_pilot_builder_t builder = {0};
+  wiz_pilot_builder_set_state(&builder, true);
+  return wiz_fleet_apply_pilot(fleet, bulb, &builder, callback, user_data);
+}
+
+int wiz_bulb_turn_off_async(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                            wiz_callback_t callback, void *user_data) {
+  wiz_pilot_builder_t builder = {0};
+  wiz_pilot_builder_set_state(&builder, false);
+  return wiz_fleet_apply_pilot(fleet, bulb, &builder, callback, user_data);
+}
+
+int wiz_bulb_set_brightness_async(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                                  uint8_t brightness, wiz_callback_t callback,
+                                  void *user_data) {
+  wiz_pilot_builder_t builder = {0};
+  _brightness_pilot(&builder, brightness);
+  return wiz_fleet_apply_pilot(fleet, bulb, &builder, callback, user_data);
+}
+
+int wiz_bulb_set_rgb_async(wiz_fleet_t *fleet, wiz_bulb_t *bulb, uint8_t r,
+                           uint8_t g, uint8_t b, wiz_callback_t callback,
+                           void *user_data) {
+  wiz_pilot_builder_t builder = {0};
+  wiz_pilot_builder_set_rgb(&builder, r, g, b);
+  return wiz_fleet_apply_pilot(fleet, bulb, &builder, callback, user_data);
+}
+
+int wiz_bulb_set_temperature_async(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                                   uint16_t temp, wiz_callback_t callback,
+                                   void *user_data) {
+  wiz_pilot_builder_t builder = {0};
+  wiz_pilot_builder_set_temperature(&builder, temp);
+  return wiz_fleet_apply_pilot(fleet, bulb, &builder, callback, user_data);
+}
+
+int wiz_bulb_set_scene_async(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                             uint16_t scene_id, wiz_callback_t callback,
+                             void *user_data) {
+  wiz_pilot_builder_t builder = {0};
+  wiz_pilot_builder_set_scene(&builder, scene_id);
+  return wiz_fleet_apply_pilot(fleet, bulb, &builder, callback, user_data);
+}
+
+int wiz_bulb_update_state_async(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                                wiz_callback_t callback, void *user_data) {
+  return wiz_fleet_update_state(fleet, bulb, callback, user_data);
+}
+
+int wiz_bulb_apply_pilot_async(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                               wiz_pilot_builder_t *builder,
+                               wiz_callback_t callback, void *user_data) {
+  return wiz_fleet_apply_pilot(fleet, bulb, builder, callback, user_data);
+}
+
+int wiz_bulb_send_pilot_async(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                              const wiz_pilot_message_t *message,
+                              wiz_callback_t callback, void *user_data) {
+  return wiz_fleet_send_pilot(fleet, bulb, message, callback, user_data);
+}
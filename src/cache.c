@@ -0,0 +1,54 @@
+#include "../include/cwiz.h"
+#include <string.h>
+
+extern uint64_t wiz_now_ms(void);
+
+// stamp fields of the cached state as confirmed now. getPilot replies and
+// syncPilot pushes describe the whole pilot, so they confirm every field:
+// a mode field they leave out (temp while in RGB mode, say) is not active
+void wiz_state_confirm(wiz_bulb_t *bulb, unsigned int fields,
+                       wiz_source_t source) {
+  uint64_t now = wiz_now_ms();
+
+  for (int i = 0; i < WIZ_FIELD_COUNT; i++) {
+    if (fields & (1u << i)) {
+      bulb->freshness.confirmed_ms[i] = now;
+      bulb->freshness.source[i] = (uint8_t)source;
+    }
+  }
+}
+
+int64_t wiz_bulb_state_age(const wiz_bulb_t *bulb, unsigned int fields) {
+  if (!bulb || (fields & ~(unsigned int)WIZ_FIELD_ALL) || fields == 0)
+    return WIZ_ERR_INVALID_PARAM;
+
+  uint64_t oldest = UINT64_MAX;
+  for (int i = 0; i < WIZ_FIELD_COUNT; i++) {
+    if (!(fields & (1u << i)))
+      continue;
+    if (bulb->freshness.confirmed_ms[i] == 0)
+      return -1;
+    if (bulb->freshness.confirmed_ms[i] < oldest)
+      oldest = bulb->freshness.confirmed_ms[i];
+  }
+
+  return (int64_t)(wiz_now_ms() - oldest);
+}
+
+// serve the cached state when every field is at most max_age_ms old,
+// otherwise refresh it with a getPilot round trip first
+int wiz_bulb_get_state_fresh(wiz_bulb_t *bulb, int max_age_ms,
+                             wiz_bulb_state_t *state) {
+  if (!bulb || !state || max_age_ms < 0)
+    return WIZ_ERR_INVALID_PARAM;
+
+  int64_t age = wiz_bulb_state_age(bulb, WIZ_FIELD_ALL);
+  if (age < 0 || age > max_age_ms) {
+    int ret = wiz_bulb_update_state(bulb);
+    if (ret != WIZ_OK)
+      return ret;
+  }
+
+  memcpy(state, &bulb->state, sizeof(wiz_bulb_state_t));
+  return WIZ_OK;
+}
@@ -1,114 +1,197 @@
 #include "../include/cwiz.h"
+#include "trace.h"
 #include <arpa/inet.h>
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <ifaddrs.h>
 #include <net/if.h>
 
-static int get_local_ip_mac(char *ip_str, char *mac_str) {
-  struct ifaddrs *ifaddr, *ifa;
-  int found = 0;
+// broadcast schedule: resend after 100 ms, doubling up to once a second
+#define DISCOVERY_FIRST_RESEND_MS 100
+#define DISCOVERY_MAX_RESEND_MS 1000
+
+typedef struct {
+  struct sockaddr_in addr;        // broadcast destination
+  char local_ip[INET_ADDRSTRLEN]; // our address on that network
+} discovery_target_t;
 
-  if (getifaddrs(&ifaddr) == -1) {
-    return -1;
+static int _add_target(discovery_target_t *targets, int count,
+                       struct in_addr addr, const char *local_ip) {
+  for (int i = 0; i < count; i++) {
+    if (targets[i].addr.sin_addr.s_addr == addr.s_addr)
+      return count;
   }
+  if (count >= WIZ_DISCOVERY_MAX_TARGETS)
+    return count;
+
+  memset(&targets[count], 0, sizeof(targets[count]));
+  targets[count].addr.sin_family = AF_INET;
+  targets[count].addr.sin_port = htons(WIZ_PORT);
+  targets[count].addr.sin_addr = addr;
+  strncpy(targets[count].local_ip, local_ip, INET_ADDRSTRLEN - 1);
+  return count + 1;
+}
 
-  for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
-    if (ifa->ifa_addr == NULL)
-      continue;
+// one target per broadcast-capable IPv4 interface, plus the caller's address
+static int collect_targets(discovery_target_t *targets,
+                           const char *broadcast_address) {
+  struct ifaddrs *ifaddr, *ifa;
+  char first_ip[INET_ADDRSTRLEN] = "0.0.0.0";
+  int count = 0;
 
-    // skip loopback
-    if (ifa->ifa_flags & IFF_LOOPBACK)
-      continue;
+  if (getifaddrs(&ifaddr) == 0) {
+    for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+      if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET)
+        continue;
 
-    // IPv4
-    if (ifa->ifa_addr->sa_family == AF_INET) {
-      if (!found) {
-        inet_ntop(AF_INET, &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr,
-                  ip_str, INET_ADDRSTRLEN);
-        
-        // mock MAC for now as getting actual MAC is platform specific and verbose
-        snprintf(mac_str, 18, "001122334455"); 
-        found = 1;
-      }
+      // skip loopback and interfaces that are down
+      if ((ifa->ifa_flags & IFF_LOOPBACK) || !(ifa->ifa_flags & IFF_UP))
+        continue;
+
+      char ip_str[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr,
+                ip_str, sizeof(ip_str));
+      if (strcmp(first_ip, "0.0.0.0") == 0)
+        strcpy(first_ip, ip_str);
+
+      if (!(ifa->ifa_flags & IFF_BROADCAST) || ifa->ifa_broadaddr == NULL)
+        continue;
+
+      count = _add_target(
+          targets, count,
+          ((struct sockaddr_in *)ifa->ifa_broadaddr)->sin_addr, ip_str);
     }
+    freeifaddrs(ifaddr);
   }
 
-  freeifaddrs(ifaddr);
-  return found ? 0 : -1;
+  if (broadcast_address) {
+    struct in_addr addr;
+    if (inet_pton(AF_INET, broadcast_address, &addr) <= 0)
+      return WIZ_ERR_INVALID_PARAM;
+    count = _add_target(targets, count, addr, first_ip);
+  }
+
+  return count;
 }
 
-extern int wiz_parse_system_config(const char *json, wiz_bulb_info_t *info);
+// send one registration broadcast to every target; returns how many went out
+static int send_round(int sock, const discovery_target_t *targets, int count,
+                      int round) {
+  // mock MAC for now as getting actual MAC is platform specific and verbose
+  const char *mac_str = "001122334455";
+  char msg[512];
+  int sent = 0;
+  (void)round; // only read by trace points
+
+  for (int i = 0; i < count; i++) {
+    int len = snprintf(msg, sizeof(msg),
+      "{\"method\":\"registration\",\"params\":{\"phoneMac\":\"%s\",\"register\":false,\"phoneIp\":\"%s\",\"id\":\"1\"}}",
+      mac_str, targets[i].local_ip);
+
+    if (sendto(sock, msg, (size_t)len, 0,
+               (const struct sockaddr *)&targets[i].addr,
+               sizeof(targets[i].addr)) >= 0)
+      sent++;
+    WIZ_TRACE(round ? WIZ_TRACE_RETRANSMIT : WIZ_TRACE_SEND, &targets[i].addr,
+              msg, round, len);
+  }
 
-wiz_bulb_registry_t *wiz_bulb_registry_create(void) {
-  wiz_bulb_registry_t *registry =
-      (wiz_bulb_registry_t *)calloc(1, sizeof(wiz_bulb_registry_t));
-  return registry;
+  return sent;
 }
 
-void wiz_bulb_registry_destroy(wiz_bulb_registry_t *registry) {
-  if (!registry)
-    return;
+extern uint64_t wiz_now_ms(void);
+extern wiz_discovered_bulb_t *wiz_registry_add(wiz_bulb_registry_t *registry,
+                                               const char *ip, const char *mac,
+                                               int *is_new);
+extern int wiz_parse_system_config(const char *json, wiz_bulb_info_t *info);
 
-  wiz_discovered_bulb_t *current = registry->bulbs;
-  while (current) {
-    wiz_discovered_bulb_t *next = current->next;
-    free(current);
-    current = next;
-  }
+// read every queued reply without blocking
+static void drain_replies(int sock, wiz_bulb_registry_t *registry,
+                          wiz_discovery_callback_t callback, void *user_data) {
+  char response[2048];
 
-  free(registry);
-}
+  for (;;) {
+    struct sockaddr_in from_addr;
+    socklen_t addr_len = sizeof(from_addr);
 
-static void registry_add_bulb(wiz_bulb_registry_t *registry, const char *ip,
-                              const char *mac) {
-  // check if bulb already exists
-  wiz_discovered_bulb_t *current = registry->bulbs;
-  while (current) {
-    if (strcmp(current->mac_address, mac) == 0) {
-      return; // already registered
+    ssize_t received = recvfrom(sock, response, sizeof(response) - 1,
+                                MSG_DONTWAIT, (struct sockaddr *)&from_addr,
+                                &addr_len);
+    if (received < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
     }
-    current = current->next;
-  }
+    response[received] = '\0';
+    WIZ_TRACE(WIZ_TRACE_RECEIVE, &from_addr, response, 0, (int)received);
+
+    // the registration reply carries the mac in its result
+    wiz_bulb_info_t info;
+    memset(&info, 0, sizeof(info));
+    int parsed = wiz_parse_system_config(response, &info);
+    if (parsed == WIZ_OK && info.mac_address[0] == '\0')
+      parsed = WIZ_ERR_JSON_PARSE;
+    WIZ_TRACE(WIZ_TRACE_PARSE, &from_addr, response, 0, parsed);
+    if (parsed != WIZ_OK)
+      continue;
 
-  // create new bulb entry
-  wiz_discovered_bulb_t *bulb =
-      (wiz_discovered_bulb_t *)malloc(sizeof(wiz_discovered_bulb_t));
-  if (!bulb)
-    return;
-
-  strncpy(bulb->ip_address, ip, sizeof(bulb->ip_address) - 1);
-  bulb->ip_address[sizeof(bulb->ip_address) - 1] = '\0';
-  strncpy(bulb->mac_address, mac, sizeof(bulb->mac_address) - 1);
-  bulb->mac_address[sizeof(bulb->mac_address) - 1] = '\0';
-  bulb->next = NULL;
-
-  // add to registry
-  if (!registry->bulbs) {
-    registry->bulbs = bulb;
-  } else {
-    current = registry->bulbs;
-    while (current->next) {
-      current = current->next;
-    }
-    current->next = bulb;
-  }
+    char ip_str[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &from_addr.sin_addr, ip_str, sizeof(ip_str));
+
+    int is_new = 0;
+    wiz_discovered_bulb_t *bulb =
+        wiz_registry_add(registry, ip_str, info.mac_address, &is_new);
+    if (!bulb)
+      continue;
+
+    bulb->last_seen = (int64_t)time(NULL);
+    if (info.module_name[0])
+      memcpy(bulb->module_name, info.module_name, sizeof(bulb->module_name));
+    if (info.firmware_version[0])
+      memcpy(bulb->firmware_version, info.firmware_version,
+             sizeof(bulb->firmware_version));
 
-  registry->count++;
+    if (is_new && callback)
+      callback(bulb, user_data);
+  }
 }
 
 int wiz_discover_bulbs(wiz_bulb_registry_t *registry,
                        const char *broadcast_address, int timeout) {
-  if (!registry || !broadcast_address) {
+  // the timeout is passed on in milliseconds
+  if (!registry || !broadcast_address || timeout < 0 ||
+      timeout > INT_MAX / 1000) {
     return WIZ_ERR_INVALID_PARAM;
   }
 
+  return wiz_discover_bulbs_ex(registry, broadcast_address, timeout * 1000,
+                               NULL, NULL);
+}
+
+// broadcast on every interface (and to broadcast_address, which may be NULL)
+// on a backoff schedule until the deadline, reporting each new bulb as soon as
+// its reply arrives
+int wiz_discover_bulbs_ex(wiz_bulb_registry_t *registry,
+                          const char *broadcast_address, int timeout_ms,
+                          wiz_discovery_callback_t callback, void *user_data) {
+  if (!registry || timeout_ms < 0) {
+    return WIZ_ERR_INVALID_PARAM;
+  }
+
+  discovery_target_t targets[WIZ_DISCOVERY_MAX_TARGETS];
+  int target_count = collect_targets(targets, broadcast_address);
+  if (target_count < 0)
+    return target_count;
+  if (target_count == 0)
+    return WIZ_ERR_CONNECTION;
+
   // create UDP socket
   int sock = socket(AF_INET, SOCK_DGRAM, 0);
   if (sock < 0) {
@@ -123,101 +206,50 @@ int wiz_discover_bulbs(wiz_bulb_registry_t *registry,
     return WIZ_ERR_SOCKET;
   }
 
-  // set socket timeout
-  struct timeval tv;
-  tv.tv_sec = timeout;
-  tv.tv_usec = 0;
-  if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-    close(sock);
-    return WIZ_ERR_SOCKET;
-  }
+  int known = registry->count;
+  uint64_t now = wiz_now_ms();
+  uint64_t deadline = now + (uint64_t)timeout_ms;
+  uint64_t next_send = now;
+  int interval = DISCOVERY_FIRST_RESEND_MS;
+  int rounds = 0;
+
+  for (;;) {
+    if (now >= next_send) {
+      // a first round that reaches nobody is a hard failure
+      if (send_round(sock, targets, target_count, rounds) == 0 &&
+          rounds == 0) {
+        close(sock);
+        return WIZ_ERR_SOCKET;
+      }
+      rounds++;
+      next_send = now + (uint64_t)interval;
+      interval *= 2;
+      if (interval > DISCOVERY_MAX_RESEND_MS)
+        interval = DISCOVERY_MAX_RESEND_MS;
+    }
 
-  // setup broadcast address
-  struct sockaddr_in broadcast_addr;
-  memset(&broadcast_addr, 0, sizeof(broadcast_addr));
-  broadcast_addr.sin_family = AF_INET;
-  broadcast_addr.sin_port = htons(WIZ_PORT);
+    if (now >= deadline)
+      break;
 
-  if (inet_pton(AF_INET, broadcast_address, &broadcast_addr.sin_addr) <= 0) {
-    close(sock);
-    return WIZ_ERR_INVALID_PARAM;
-  }
+    uint64_t wake = next_send < deadline ? next_send : deadline;
+    struct pollfd pfd = {.fd = sock, .events = POLLIN};
+    int ready = poll(&pfd, 1, (int)(wake - now));
+    if (ready < 0 && errno != EINTR) {
+      close(sock);
+      return WIZ_ERR_SOCKET;
+    }
+    if (ready > 0)
+      drain_replies(sock, registry, callback, user_data);
 
-  // prepare registration message
-  char ip_str[INET_ADDRSTRLEN] = "0.0.0.0";
-  char mac_str[18] = "000000000000";
-  char msg[512];
-  
-  get_local_ip_mac(ip_str, mac_str);
-  
-  snprintf(msg, sizeof(msg), 
-    "{\"method\":\"registration\",\"params\":{\"phoneMac\":\"%s\",\"register\":false,\"phoneIp\":\"%s\",\"id\":\"1\"}}",
-    mac_str, ip_str);
-
-  // send broadcast message
-  ssize_t sent =
-      sendto(sock, msg, strlen(msg), 0,
-             (struct sockaddr *)&broadcast_addr, sizeof(broadcast_addr));
-
-  if (sent < 0) {
-    close(sock);
-    return WIZ_ERR_SOCKET;
+    now = wiz_now_ms();
   }
 
-  // receive responses
-  time_t start_time = time(NULL);
-  char response[2048];
-
-  while (time(NULL) - start_time < timeout) {
-    struct sockaddr_in from_addr;
-    socklen_t addr_len = sizeof(from_addr);
-
-    ssize_t received = recvfrom(sock, response, sizeof(response) - 1, 0,
-                                (struct sockaddr *)&from_addr, &addr_len);
-
-    if (received > 0) {
-      response[received] = '\0';
-
-      // extract IP address
-      char ip_str[INET_ADDRSTRLEN];
-      inet_ntop(AF_INET, &from_addr.sin_addr, ip_str, sizeof(ip_str));
-
-      // parse MAC address from response
-      const char *mac_ptr = strstr(response, "\"mac\":");
-      if (mac_ptr) {
-        mac_ptr += 7; // skip "mac":" "
-        while (*mac_ptr == ' ' || *mac_ptr == '\"')
-          mac_ptr++;
-
-        char mac_str[18];
-        sscanf(mac_ptr, "%17[^\"]", mac_str);
-
-        // add to registry
-        registry_add_bulb(registry, ip_str, mac_str);
-      }
-    } else if (received < 0 && errno == EAGAIN) {
-      // timeout - no more responses
-      break;
-    }
-  }
+  // pick up anything that landed with the deadline; a scan that turned up
+  // no new bulb ran out its time for nothing
+  drain_replies(sock, registry, callback, user_data);
+  if (registry->count == known)
+    WIZ_TRACE(WIZ_TRACE_TIMEOUT, NULL, NULL, rounds, WIZ_ERR_TIMEOUT);
 
   close(sock);
   return registry->count;
 }
-
-wiz_discovered_bulb_t *wiz_registry_get_by_mac(wiz_bulb_registry_t *registry,
-                                               const char *mac_address) {
-  if (!registry || !mac_address) {
-    return NULL;
-  }
-
-  wiz_discovered_bulb_t *current = registry->bulbs;
-  while (current) {
-    if (strcmp(current->mac_address, mac_address) == 0) {
-      return current;
-    }
-    current = current->next;
-  }
-
-  return NULL;
-}
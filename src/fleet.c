@@ -0,0 +1,1427 @@
+#define _GNU_SOURCE // sendmmsg, recvmmsg
+#include "../include/cwiz.h"
+#include "trace.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#ifdef CWIZ_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+extern int wiz_build_json_message(char *buffer, size_t size, const char *method,
+                                  const char *params);
+extern int wiz_parse_pilot_reply(const char *json, wiz_bulb_state_t *state,
+                                 wiz_bulb_info_t *info);
+extern int wiz_build_pilot_message(char *buffer, size_t size,
+                                   const wiz_pilot_builder_t *builder,
+                                   uint32_t *id);
+extern void wiz_pilot_builder_commit(const wiz_pilot_builder_t *builder,
+                                     wiz_bulb_state_t *state);
+extern unsigned int wiz_pilot_builder_fields(const wiz_pilot_builder_t *builder);
+extern void wiz_state_confirm(wiz_bulb_t *bulb, unsigned int fields,
+                              wiz_source_t source);
+extern void wiz_pilot_builder_merge(wiz_pilot_builder_t *dst,
+                                    const wiz_pilot_builder_t *src);
+extern unsigned int wiz_rtt_timeout_ms(const wiz_rtt_t *rtt, int attempt);
+extern void wiz_rtt_sample(wiz_rtt_t *rtt, uint32_t rtt_ms);
+extern void wiz_rtt_reset(wiz_rtt_t *rtt);
+extern uint64_t wiz_now_ms(void);
+extern int wiz_create_socket(void);
+extern int wiz_bulb_reply_matches(wiz_bulb_t *bulb, const char *request,
+                                  const char *response);
+extern void wiz_metrics_sent(wiz_bulb_t *bulb, size_t bytes, int attempt);
+extern void wiz_metrics_received(wiz_bulb_t *bulb, size_t bytes);
+extern void wiz_metrics_stale(wiz_bulb_t *bulb);
+extern void wiz_metrics_rtt(wiz_bulb_t *bulb, uint32_t rtt_ms);
+extern void wiz_metrics_done(wiz_bulb_t *bulb, int result);
+extern uint32_t wiz_stamp_request_id(char *message);
+extern const wiz_pilot_builder_t *
+wiz_pilot_message_builder(const wiz_pilot_message_t *message);
+#ifdef CWIZ_IO_URING
+typedef struct wiz_uring wiz_uring_t;
+extern wiz_uring_t *wiz_uring_create(unsigned entries, unsigned cq_entries);
+extern void wiz_uring_destroy(wiz_uring_t *ring);
+extern int wiz_uring_fd(const wiz_uring_t *ring);
+extern struct io_uring_sqe *wiz_uring_get_sqe(wiz_uring_t *ring);
+extern int wiz_uring_submit(wiz_uring_t *ring, unsigned wait_nr);
+extern struct io_uring_cqe *wiz_uring_peek_cqe(wiz_uring_t *ring);
+extern void wiz_uring_cqe_seen(wiz_uring_t *ring);
+extern int wiz_uring_setup_buffers(wiz_uring_t *ring, uint16_t group,
+                                   unsigned count, unsigned size);
+extern char *wiz_uring_buffer(wiz_uring_t *ring, unsigned bid);
+extern void wiz_uring_recycle(wiz_uring_t *ring, unsigned bid);
+extern int wiz_uring_recv_multishot(wiz_uring_t *ring, int fd,
+                                    struct msghdr *msg, uint64_t user_data);
+extern void wiz_uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                                   const struct msghdr *msg,
+                                   uint64_t user_data);
+#endif
+
+#define FLEET_MAX_EVENTS 64
+#define FLEET_BATCH 64 // datagrams per sendmmsg/recvmmsg call
+#define FLEET_RX_SIZE 1024
+
+#define FLEET_SOCKET_BUFFER (1 << 20)
+
+#ifdef CWIZ_IO_URING
+#define FLEET_RING_ENTRIES 256
+#define FLEET_RING_CQ_ENTRIES 4096
+#define FLEET_RING_BUFFERS 256 // provided receive buffers, a power of two
+#define FLEET_RING_TX 256      // datagrams in flight through the ring
+
+// completion tags: kind in the high half, socket or tx index in the low half
+#define FLEET_TAG_RECV (1ULL << 32)
+#define FLEET_TAG_SEND (2ULL << 32)
+
+// a datagram handed to the ring; owns a copy of the message so the request
+// slot can be reused or retransmitted before the send completes
+typedef struct {
+  struct msghdr msg;
+  struct iovec iov;
+  struct sockaddr_in addr;
+  char data[512];
+  int slot;
+  uint32_t gen; // the request's timer_gen when it was armed
+  int next;     // free list
+} fleet_tx_t;
+#endif
+
+typedef enum {
+  FLEET_SET_PILOT,
+  FLEET_GET_PILOT,
+  FLEET_EXCHANGE // caller-built message, reply copied out verbatim
+} fleet_kind_t;
+
+// one outstanding exchange with a bulb
+typedef struct {
+  wiz_bulb_t *bulb;
+  bool in_use;
+  fleet_kind_t kind;
+  wiz_pilot_builder_t pilot; // fields committed to the cache on ack
+  char *reply;               // FLEET_EXCHANGE only
+  size_t reply_size;
+  char message[512];
+  size_t message_len;
+  int attempts;
+  bool sent; // a datagram for this request has left; replies count only then
+  int queue_pos; // index in send_queue, -1 when not queued
+  uint64_t first_sent_ms;
+  uint64_t deadline_ms; // give up at this time, 0 for the retry budget only
+  int send_error; // set when the kernel refused the datagram
+  uint32_t timer_gen;
+  int next; // next request queued behind this one for the same bulb
+  int tail; // last request in the queue (only valid on the head)
+  bool dirty; // pilot changed by a merge, message must be rebuilt
+  // submissions coalesced into this one; they complete with it
+  int merged_head;
+  int merged_tail;
+  wiz_callback_t callback;
+  void *user_data;
+} fleet_request_t;
+
+typedef struct {
+  uint64_t deadline_ms;
+  int slot;
+  uint32_t gen;
+} fleet_timer_t;
+
+struct wiz_fleet {
+  int epoll_fd;
+  uint32_t id; // process-unique, recorded in the bulbs it watches
+
+  // sockets shared by bulbs from wiz_bulb_create_shared()
+  int sockets[WIZ_FLEET_MAX_SOCKETS];
+  int socket_count;
+
+  fleet_request_t *requests;
+  int capacity;
+  int free_head; // free slots are chained through `next`
+  int active;    // submitted and not yet completed
+
+  // source address -> slot of the request currently in flight, so replies
+  // can be demultiplexed without scanning every request
+  uint64_t *index_keys;
+  int *index_slots;
+  uint32_t index_mask;
+  int index_count;
+
+  // min-heap of retransmit deadlines; stale entries are skipped lazily
+  fleet_timer_t *timers;
+  int timer_count;
+  int timer_capacity;
+
+  // requests waiting for their (re)transmission
+  int *send_queue;
+  int send_count;
+
+  // preallocated receive ring for recvmmsg; callbacks that re-enter the
+  // fleet while it is being drained fall back to a stack buffer
+  char rx_buffers[FLEET_BATCH][FLEET_RX_SIZE];
+  struct sockaddr_in rx_addrs[FLEET_BATCH];
+  struct iovec rx_iov[FLEET_BATCH];
+  struct mmsghdr rx_msgs[FLEET_BATCH];
+  int rx_depth;
+
+#ifdef CWIZ_IO_URING
+  // pool sockets go through the ring when it could be set up: batched
+  // sendmsg entries and one multishot recvmsg per socket; NULL otherwise
+  wiz_uring_t *ring;
+  struct msghdr ring_rx_msg; // layout template for multishot receives
+  fleet_tx_t tx[FLEET_RING_TX];
+  int tx_free;
+  int tx_inflight;
+#endif
+};
+
+static uint64_t _addr_key(const struct sockaddr_in *addr) {
+  return ((uint64_t)addr->sin_addr.s_addr << 16) | addr->sin_port;
+}
+
+static uint32_t _hash_key(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return (uint32_t)key;
+}
+
+// address index (open addressing, linear probing)
+
+static int _index_find(wiz_fleet_t *fleet, uint64_t key) {
+  uint32_t i = _hash_key(key) & fleet->index_mask;
+  while (fleet->index_slots[i] >= 0) {
+    if (fleet->index_keys[i] == key)
+      return (int)i;
+    i = (i + 1) & fleet->index_mask;
+  }
+  return -1;
+}
+
+static int _index_grow(wiz_fleet_t *fleet) {
+  uint32_t old_size = fleet->index_mask + 1;
+  uint64_t *old_keys = fleet->index_keys;
+  int *old_slots = fleet->index_slots;
+  uint32_t new_size = old_size * 2;
+
+  uint64_t *keys = (uint64_t *)malloc(new_size * sizeof(uint64_t));
+  int *slots = (int *)malloc(new_size * sizeof(int));
+  if (!keys || !slots) {
+    free(keys);
+    free(slots);
+    return WIZ_ERR_MALLOC;
+  }
+  for (uint32_t i = 0; i < new_size; i++)
+    slots[i] = -1;
+
+  fleet->index_keys = keys;
+  fleet->index_slots = slots;
+  fleet->index_mask = new_size - 1;
+
+  for (uint32_t i = 0; i < old_size; i++) {
+    if (old_slots[i] < 0)
+      continue;
+    uint32_t j = _hash_key(old_keys[i]) & fleet->index_mask;
+    while (slots[j] >= 0)
+      j = (j + 1) & fleet->index_mask;
+    keys[j] = old_keys[i];
+    slots[j] = old_slots[i];
+  }
+
+  free(old_keys);
+  free(old_slots);
+  return WIZ_OK;
+}
+
+static int _index_insert(wiz_fleet_t *fleet, uint64_t key, int slot) {
+  if ((uint32_t)(fleet->index_count + 1) * 2 > fleet->index_mask + 1) {
+    if (_index_grow(fleet) != WIZ_OK)
+      return WIZ_ERR_MALLOC;
+  }
+
+  uint32_t i = _hash_key(key) & fleet->index_mask;
+  while (fleet->index_slots[i] >= 0)
+    i = (i + 1) & fleet->index_mask;
+  fleet->index_keys[i] = key;
+  fleet->index_slots[i] = slot;
+  fleet->index_count++;
+  return WIZ_OK;
+}
+
+static void _index_remove(wiz_fleet_t *fleet, int pos) {
+  // backward-shift deletion keeps probe chains intact without tombstones
+  uint32_t i = (uint32_t)pos;
+  uint32_t j = i;
+  for (;;) {
+    j = (j + 1) & fleet->index_mask;
+    if (fleet->index_slots[j] < 0)
+      break;
+    uint32_t home = _hash_key(fleet->index_keys[j]) & fleet->index_mask;
+    // move j into the hole at i unless its home lies cyclically in (i, j]
+    if ((j > i && (home <= i || home > j)) ||
+        (j < i && (home <= i && home > j))) {
+      fleet->index_keys[i] = fleet->index_keys[j];
+      fleet->index_slots[i] = fleet->index_slots[j];
+      i = j;
+    }
+  }
+  fleet->index_slots[i] = -1;
+  fleet->index_count--;
+}
+
+// retransmit timers
+
+static int _timer_push(wiz_fleet_t *fleet, uint64_t deadline_ms, int slot) {
+  if (fleet->timer_count == fleet->timer_capacity) {
+    int capacity = fleet->timer_capacity ? fleet->timer_capacity * 2 : 64;
+    fleet_timer_t *timers = (fleet_timer_t *)realloc(
+        fleet->timers, (size_t)capacity * sizeof(fleet_timer_t));
+    if (!timers)
+      return WIZ_ERR_MALLOC;
+    fleet->timers = timers;
+    fleet->timer_capacity = capacity;
+  }
+
+  fleet_timer_t timer = {deadline_ms, slot, fleet->requests[slot].timer_gen};
+  int i = fleet->timer_count++;
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (fleet->timers[parent].deadline_ms <= deadline_ms)
+      break;
+    fleet->timers[i] = fleet->timers[parent];
+    i = parent;
+  }
+  fleet->timers[i] = timer;
+  return WIZ_OK;
+}
+
+static void _timer_pop(wiz_fleet_t *fleet) {
+  fleet_timer_t last = fleet->timers[--fleet->timer_count];
+  int i = 0;
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= fleet->timer_count)
+      break;
+    if (child + 1 < fleet->timer_count &&
+        fleet->timers[child + 1].deadline_ms < fleet->timers[child].deadline_ms)
+      child++;
+    if (last.deadline_ms <= fleet->timers[child].deadline_ms)
+      break;
+    fleet->timers[i] = fleet->timers[child];
+    i = child;
+  }
+  if (fleet->timer_count > 0)
+    fleet->timers[i] = last;
+}
+
+static bool _timer_is_live(wiz_fleet_t *fleet, const fleet_timer_t *timer) {
+  const fleet_request_t *req = &fleet->requests[timer->slot];
+  return req->in_use && req->timer_gen == timer->gen;
+}
+
+// drop cancelled timers from the top so the head is always a live deadline
+static void _timer_prune(wiz_fleet_t *fleet) {
+  while (fleet->timer_count > 0 &&
+         !_timer_is_live(fleet, &fleet->timers[0])) {
+    _timer_pop(fleet);
+  }
+}
+
+// request slots
+
+static int _slot_alloc(wiz_fleet_t *fleet) {
+  if (fleet->free_head < 0) {
+    int capacity = fleet->capacity ? fleet->capacity * 2 : 64;
+    fleet_request_t *requests = (fleet_request_t *)realloc(
+        fleet->requests, (size_t)capacity * sizeof(fleet_request_t));
+    if (!requests)
+      return WIZ_ERR_MALLOC;
+    int *send_queue =
+        (int *)realloc(fleet->send_queue, (size_t)capacity * sizeof(int));
+    if (!send_queue) {
+      fleet->requests = requests;
+      return WIZ_ERR_MALLOC;
+    }
+
+    for (int i = fleet->capacity; i < capacity; i++) {
+      memset(&requests[i], 0, sizeof(requests[i]));
+      requests[i].next = (i + 1 < capacity) ? i + 1 : -1;
+    }
+    fleet->free_head = fleet->capacity;
+    fleet->requests = requests;
+    fleet->send_queue = send_queue;
+    fleet->capacity = capacity;
+  }
+
+  int slot = fleet->free_head;
+  fleet->free_head = fleet->requests[slot].next;
+  fleet->requests[slot].in_use = true;
+  fleet->requests[slot].next = -1;
+  fleet->requests[slot].tail = slot;
+  fleet->requests[slot].dirty = false;
+  fleet->requests[slot].merged_head = -1;
+  fleet->requests[slot].merged_tail = -1;
+  fleet->requests[slot].sent = false;
+  fleet->requests[slot].queue_pos = -1;
+  return slot;
+}
+
+// queue a request for the next flush; a slot is queued at most once
+static void _queue_send(wiz_fleet_t *fleet, int slot) {
+  fleet_request_t *req = &fleet->requests[slot];
+  if (req->queue_pos >= 0)
+    return;
+  req->queue_pos = fleet->send_count;
+  fleet->send_queue[fleet->send_count++] = slot;
+}
+
+// take a request off the send queue, so a slot that completes (and may be
+// reused) before the flush is never sent for its old request
+static void _unqueue_send(wiz_fleet_t *fleet, int slot) {
+  fleet_request_t *req = &fleet->requests[slot];
+  int pos = req->queue_pos;
+  if (pos < 0)
+    return;
+
+  int last = fleet->send_queue[--fleet->send_count];
+  fleet->send_queue[pos] = last;
+  fleet->requests[last].queue_pos = pos;
+  req->queue_pos = -1;
+}
+
+static void _slot_free(wiz_fleet_t *fleet, int slot) {
+  _unqueue_send(fleet, slot);
+
+  fleet_request_t *req = &fleet->requests[slot];
+  req->in_use = false;
+  req->bulb = NULL;
+  req->timer_gen++;
+  req->next = fleet->free_head;
+  fleet->free_head = slot;
+}
+
+static void _start_request(wiz_fleet_t *fleet, int slot) {
+  fleet_request_t *req = &fleet->requests[slot];
+
+  // the merged fields are a union of builders that each fit on their own,
+  // so this cannot outgrow the buffers
+  if (req->dirty) {
+    int length = wiz_build_pilot_message(req->message, sizeof(req->message),
+                                         &req->pilot, NULL);
+    if (length > 0)
+      req->message_len = (size_t)length;
+    req->dirty = false;
+  }
+
+  req->attempts = 0;
+  req->sent = false;
+  req->first_sent_ms = 0;
+  req->send_error = WIZ_OK;
+  _queue_send(fleet, slot);
+}
+
+// finish the in-flight request for a bulb and start the next queued one
+static void _complete(wiz_fleet_t *fleet, int slot, int result) {
+  fleet_request_t *req = &fleet->requests[slot];
+  wiz_bulb_t *bulb = req->bulb;
+  wiz_callback_t callback = req->callback;
+  void *user_data = req->user_data;
+  int merged = req->merged_head;
+
+  wiz_metrics_done(bulb, result);
+  if (result == WIZ_OK && req->kind == FLEET_SET_PILOT) {
+    wiz_pilot_builder_commit(&req->pilot, &bulb->state);
+    wiz_state_confirm(bulb, wiz_pilot_builder_fields(&req->pilot),
+                      WIZ_SOURCE_ACK);
+  }
+
+  int pos = _index_find(fleet, _addr_key(&bulb->addr));
+  int next = req->next;
+  if (next >= 0) {
+    fleet->requests[next].tail = req->tail;
+    if (pos >= 0)
+      fleet->index_slots[pos] = next;
+    _start_request(fleet, next);
+  } else if (pos >= 0) {
+    _index_remove(fleet, pos);
+  }
+
+  _slot_free(fleet, slot);
+  fleet->active--;
+
+  // the callback may submit new requests, so no slot pointers survive it
+  if (callback)
+    callback(bulb, result, &bulb->state, user_data);
+
+  // coalesced submissions share the outcome of the request that carried them
+  while (merged >= 0) {
+    req = &fleet->requests[merged];
+    callback = req->callback;
+    user_data = req->user_data;
+    int following = req->next;
+    _slot_free(fleet, merged);
+    fleet->active--;
+    if (callback)
+      callback(bulb, result, &bulb->state, user_data);
+    merged = following;
+  }
+}
+
+static int _watch_socket(wiz_fleet_t *fleet, int fd) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(fleet->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0 &&
+      errno != EEXIST) {
+    return WIZ_ERR_SOCKET;
+  }
+  return WIZ_OK;
+}
+
+// a setPilot comes either as a builder or as a compiled message serialized
+// once for many sends; message is the caller-built request of an exchange
+static int _submit(wiz_fleet_t *fleet, wiz_bulb_t *bulb, fleet_kind_t kind,
+                   const wiz_pilot_builder_t *builder,
+                   const wiz_pilot_message_t *compiled, const char *message,
+                   char *reply, size_t reply_size, wiz_callback_t callback,
+                   void *user_data, uint64_t deadline_ms) {
+  // a shared socket is only ever read by the fleet that owns it
+  if (bulb->fleet && bulb->fleet != fleet)
+    return WIZ_ERR_INVALID_PARAM;
+
+  // pool sockets were registered when the pool was created (or belong to
+  // the ring's multishot receive); a bulb's own socket is added once
+  if (bulb->fleet != fleet && bulb->watched_by != fleet->id) {
+    int ret = _watch_socket(fleet, bulb->socket_fd);
+    if (ret != WIZ_OK)
+      return ret;
+    bulb->watched_by = fleet->id;
+  }
+
+  int ret;
+  int slot = _slot_alloc(fleet);
+  if (slot < 0)
+    return slot;
+
+  uint64_t key = _addr_key(&bulb->addr);
+  int pos = _index_find(fleet, key);
+  if (compiled)
+    builder = wiz_pilot_message_builder(compiled);
+
+  // latest value wins: while the bulb is busy, a setPilot waiting behind the
+  // in-flight request absorbs later field updates instead of queueing another
+  // round trip
+  if (kind == FLEET_SET_PILOT && pos >= 0) {
+    int head = fleet->index_slots[pos];
+    int tail = fleet->requests[head].tail;
+    fleet_request_t *pending = &fleet->requests[tail];
+    if (tail != head && pending->kind == FLEET_SET_PILOT) {
+      wiz_pilot_builder_merge(&pending->pilot, builder);
+      pending->dirty = true;
+
+      fleet_request_t *req = &fleet->requests[slot];
+      req->bulb = bulb;
+      req->kind = FLEET_SET_PILOT;
+      req->callback = callback;
+      req->user_data = user_data;
+      if (pending->merged_tail >= 0)
+        fleet->requests[pending->merged_tail].next = slot;
+      else
+        pending->merged_head = slot;
+      pending->merged_tail = slot;
+
+      fleet->active++;
+      return WIZ_OK;
+    }
+  }
+
+  fleet_request_t *req = &fleet->requests[slot];
+  req->bulb = bulb;
+  req->kind = kind;
+  req->reply = reply;
+  req->reply_size = reply_size;
+  req->callback = callback;
+  req->user_data = user_data;
+  req->deadline_ms = deadline_ms;
+  memset(&req->pilot, 0, sizeof(req->pilot));
+
+  if (kind == FLEET_GET_PILOT) {
+    ret = wiz_build_json_message(req->message, sizeof(req->message),
+                                 "getPilot", NULL);
+  } else if (kind == FLEET_SET_PILOT && compiled) {
+    // already serialized once; each request gets its own copy and id, so a
+    // late ack to an earlier send of the message cannot complete this one
+    size_t length;
+    const char *data = wiz_pilot_message_data(compiled, &length);
+    req->pilot = *builder;
+    memcpy(req->message, data, length + 1);
+    wiz_stamp_request_id(req->message);
+    ret = WIZ_OK;
+  } else if (kind == FLEET_SET_PILOT) {
+    req->pilot = *builder;
+    ret = wiz_build_pilot_message(req->message, sizeof(req->message), builder,
+                                  NULL);
+    if (ret > 0)
+      ret = WIZ_OK;
+  } else if (strlen(message) < sizeof(req->message)) {
+    strcpy(req->message, message);
+    ret = WIZ_OK;
+  } else {
+    ret = WIZ_ERR_INVALID_PARAM;
+  }
+  if (ret != WIZ_OK) {
+    _slot_free(fleet, slot);
+    return ret;
+  }
+  req->message_len = strlen(req->message);
+
+  // only one exchange per bulb may be in flight, otherwise replies could not
+  // be told apart; later requests queue behind the current one
+  if (pos >= 0) {
+    fleet_request_t *head = &fleet->requests[fleet->index_slots[pos]];
+    fleet->requests[head->tail].next = slot;
+    head->tail = slot;
+  } else {
+    ret = _index_insert(fleet, key, slot);
+    if (ret != WIZ_OK) {
+      _slot_free(fleet, slot);
+      return ret;
+    }
+    _start_request(fleet, slot);
+  }
+
+  fleet->active++;
+  return WIZ_OK;
+}
+
+static int _timer_reserve(wiz_fleet_t *fleet, int extra) {
+  if (fleet->timer_count + extra <= fleet->timer_capacity)
+    return WIZ_OK;
+
+  int capacity = fleet->timer_capacity ? fleet->timer_capacity : 64;
+  while (capacity < fleet->timer_count + extra)
+    capacity *= 2;
+  fleet_timer_t *timers = (fleet_timer_t *)realloc(
+      fleet->timers, (size_t)capacity * sizeof(fleet_timer_t));
+  if (!timers)
+    return WIZ_ERR_MALLOC;
+  fleet->timers = timers;
+  fleet->timer_capacity = capacity;
+  return WIZ_OK;
+}
+
+// arm the retransmit timer for a request that was just handed to the kernel;
+// a hard send error expires immediately and is reported from the timer
+static void _arm(wiz_fleet_t *fleet, int slot, int send_error, uint64_t now) {
+  fleet_request_t *req = &fleet->requests[slot];
+  req->sent = true;
+  req->send_error = send_error;
+  req->timer_gen++;
+  if (req->attempts == 0)
+    req->first_sent_ms = now;
+  uint64_t deadline =
+      send_error ? now : now + wiz_rtt_timeout_ms(&req->bulb->rtt, req->attempts);
+  if (req->deadline_ms && req->deadline_ms < deadline)
+    deadline = req->deadline_ms;
+  _timer_push(fleet, deadline, slot);
+}
+
+static int _send_error(void) {
+  // a full socket buffer is treated like a lost datagram
+  return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+             ? WIZ_OK
+             : WIZ_ERR_SOCKET;
+}
+
+static void _send_one(wiz_fleet_t *fleet, int slot, uint64_t now) {
+  fleet_request_t *req = &fleet->requests[slot];
+  ssize_t sent = sendto(req->bulb->socket_fd, req->message, req->message_len,
+                        MSG_DONTWAIT, (struct sockaddr *)&req->bulb->addr,
+                        sizeof(req->bulb->addr));
+  _arm(fleet, slot, sent < 0 ? _send_error() : WIZ_OK, now);
+}
+
+static void _send_batch(wiz_fleet_t *fleet, int fd, const int *slots, int count,
+                        uint64_t now) {
+  struct mmsghdr msgs[FLEET_BATCH];
+  struct iovec iov[FLEET_BATCH];
+
+  memset(msgs, 0, sizeof(msgs[0]) * (size_t)count);
+  for (int i = 0; i < count; i++) {
+    fleet_request_t *req = &fleet->requests[slots[i]];
+    iov[i].iov_base = (void *)req->message;
+    iov[i].iov_len = req->message_len;
+    msgs[i].msg_hdr.msg_name = &req->bulb->addr;
+    msgs[i].msg_hdr.msg_namelen = sizeof(req->bulb->addr);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  int sent = sendmmsg(fd, msgs, (unsigned int)count, MSG_DONTWAIT);
+  int error = WIZ_OK;
+  if (sent < 0) {
+    error = _send_error();
+    sent = 0;
+  }
+
+  // datagrams after the first refused one never left; unless the socket is
+  // broken they are simply retransmitted when their timer fires
+  for (int i = 0; i < count; i++)
+    _arm(fleet, slots[i], i < sent ? WIZ_OK : error, now);
+}
+
+#ifdef CWIZ_IO_URING
+// queue sendmsg entries for a pool socket on the ring; whatever finds no free
+// tx entry or submission slot goes out through sendmmsg instead
+static void _ring_send_batch(wiz_fleet_t *fleet, int fd, const int *slots,
+                             int count, uint64_t now) {
+  int queued = 0;
+
+  for (; queued < count && fleet->tx_free >= 0; queued++) {
+    struct io_uring_sqe *sqe = wiz_uring_get_sqe(fleet->ring);
+    if (!sqe) {
+      // submission queue full: hand it over and try once more
+      wiz_uring_submit(fleet->ring, 0);
+      sqe = wiz_uring_get_sqe(fleet->ring);
+      if (!sqe)
+        break;
+    }
+
+    int index = fleet->tx_free;
+    fleet_tx_t *tx = &fleet->tx[index];
+    fleet->tx_free = tx->next;
+    fleet->tx_inflight++;
+
+    fleet_request_t *req = &fleet->requests[slots[queued]];
+    memcpy(tx->data, req->message, req->message_len);
+    tx->addr = req->bulb->addr;
+    tx->iov.iov_base = tx->data;
+    tx->iov.iov_len = req->message_len;
+    memset(&tx->msg, 0, sizeof(tx->msg));
+    tx->msg.msg_name = &tx->addr;
+    tx->msg.msg_namelen = sizeof(tx->addr);
+    tx->msg.msg_iov = &tx->iov;
+    tx->msg.msg_iovlen = 1;
+    wiz_uring_prep_sendmsg(sqe, fd, &tx->msg, FLEET_TAG_SEND | (uint64_t)index);
+
+    // the timer runs from submission; a failed send re-arms it on completion
+    _arm(fleet, slots[queued], WIZ_OK, now);
+    tx->slot = slots[queued];
+    tx->gen = req->timer_gen;
+  }
+
+  if (queued < count)
+    _send_batch(fleet, fd, slots + queued, count - queued, now);
+}
+#endif
+
+static void _send_pool(wiz_fleet_t *fleet, int fd, const int *slots, int count,
+                       uint64_t now) {
+#ifdef CWIZ_IO_URING
+  if (fleet->ring) {
+    _ring_send_batch(fleet, fd, slots, count, now);
+    return;
+  }
+#endif
+  _send_batch(fleet, fd, slots, count, now);
+}
+
+// transmit everything queued; datagrams for the same pool socket go out in
+// one sendmmsg call (or one ring submission). Never runs callbacks, so the
+// queue cannot change here.
+static void _flush_sends(wiz_fleet_t *fleet) {
+  if (fleet->send_count == 0)
+    return;
+  if (_timer_reserve(fleet, fleet->send_count) != WIZ_OK)
+    return; // retried on the next poll
+
+  uint64_t now = wiz_now_ms();
+  int batch[FLEET_BATCH];
+
+  for (int i = 0; i < fleet->send_count; i++) {
+    fleet_request_t *req = &fleet->requests[fleet->send_queue[i]];
+    wiz_metrics_sent(req->bulb, req->message_len, req->attempts);
+    WIZ_TRACE(req->attempts ? WIZ_TRACE_RETRANSMIT : WIZ_TRACE_SEND,
+              &req->bulb->addr, req->message, req->attempts,
+              (int)req->message_len);
+  }
+
+  for (int i = 0; i < fleet->send_count; i++) {
+    int slot = fleet->send_queue[i];
+    if (fleet->requests[slot].bulb->fleet != fleet)
+      _send_one(fleet, slot, now);
+  }
+
+  for (int k = 0; k < fleet->socket_count; k++) {
+    int fd = fleet->sockets[k];
+    int count = 0;
+    for (int i = 0; i < fleet->send_count; i++) {
+      int slot = fleet->send_queue[i];
+      if (fleet->requests[slot].bulb->socket_fd != fd ||
+          fleet->requests[slot].bulb->fleet != fleet)
+        continue;
+      batch[count++] = slot;
+      if (count == FLEET_BATCH) {
+        _send_pool(fleet, fd, batch, count, now);
+        count = 0;
+      }
+    }
+    if (count > 0)
+      _send_pool(fleet, fd, batch, count, now);
+  }
+
+#ifdef CWIZ_IO_URING
+  if (fleet->ring)
+    wiz_uring_submit(fleet->ring, 0);
+#endif
+
+  for (int i = 0; i < fleet->send_count; i++)
+    fleet->requests[fleet->send_queue[i]].queue_pos = -1;
+  fleet->send_count = 0;
+}
+
+// match one datagram to the request in flight for its sender; returns 1 when
+// a request completed
+static int _dispatch(wiz_fleet_t *fleet, int fd, const struct sockaddr_in *from,
+                     char *response, size_t length) {
+  response[length] = '\0';
+
+  int pos = _index_find(fleet, _addr_key(from));
+  if (pos < 0)
+    return 0; // nothing outstanding for this sender
+
+  int slot = fleet->index_slots[pos];
+  fleet_request_t *req = &fleet->requests[slot];
+  if (req->bulb->socket_fd != fd)
+    return 0;
+  wiz_metrics_received(req->bulb, length);
+  WIZ_TRACE(WIZ_TRACE_RECEIVE, from, response, req->attempts, (int)length);
+
+  // a late answer to an earlier request must not complete this one, and a
+  // request still waiting for its first flush cannot have been answered
+  if (!req->sent ||
+      !wiz_bulb_reply_matches(req->bulb, req->message, response)) {
+    wiz_metrics_stale(req->bulb);
+    WIZ_TRACE(WIZ_TRACE_PARSE, from, response, req->attempts,
+              WIZ_ERR_JSON_PARSE);
+    return 0;
+  }
+
+  // Karn: a retransmitted exchange gives an ambiguous round trip, and only
+  // a request that went out has a send time to measure from
+  if (req->sent && req->attempts == 0) {
+    uint32_t rtt_ms = (uint32_t)(wiz_now_ms() - req->first_sent_ms);
+    wiz_rtt_sample(&req->bulb->rtt, rtt_ms);
+    wiz_metrics_rtt(req->bulb, rtt_ms);
+  }
+
+  int result = WIZ_OK;
+  if (req->kind == FLEET_GET_PILOT) {
+    result = wiz_parse_pilot_reply(response, &req->bulb->state,
+                                   &req->bulb->info);
+    if (result == WIZ_OK)
+      wiz_state_confirm(req->bulb, WIZ_FIELD_ALL, WIZ_SOURCE_POLL);
+  } else if (req->kind == FLEET_EXCHANGE && req->reply) {
+    if (length >= req->reply_size)
+      length = req->reply_size - 1;
+    memcpy(req->reply, response, length);
+    req->reply[length] = '\0';
+  }
+  WIZ_TRACE(WIZ_TRACE_PARSE, from, response, req->attempts, result);
+
+  _complete(fleet, slot, result);
+  return 1;
+}
+
+static int _read_socket(wiz_fleet_t *fleet, int fd) {
+  int completed = 0;
+
+  if (fleet->rx_depth > 0) {
+    char response[FLEET_RX_SIZE];
+    for (;;) {
+      struct sockaddr_in from;
+      socklen_t from_len = sizeof(from);
+      ssize_t received = recvfrom(fd, response, sizeof(response) - 1,
+                                  MSG_DONTWAIT, (struct sockaddr *)&from,
+                                  &from_len);
+      if (received < 0) {
+        if (errno == EINTR)
+          continue;
+        return completed;
+      }
+      if (received > 0)
+        completed += _dispatch(fleet, fd, &from, response, (size_t)received);
+    }
+  }
+
+  fleet->rx_depth++;
+  for (;;) {
+    for (int i = 0; i < FLEET_BATCH; i++) {
+      fleet->rx_iov[i].iov_base = fleet->rx_buffers[i];
+      fleet->rx_iov[i].iov_len = FLEET_RX_SIZE - 1;
+      memset(&fleet->rx_msgs[i], 0, sizeof(fleet->rx_msgs[i]));
+      fleet->rx_msgs[i].msg_hdr.msg_name = &fleet->rx_addrs[i];
+      fleet->rx_msgs[i].msg_hdr.msg_namelen = sizeof(fleet->rx_addrs[i]);
+      fleet->rx_msgs[i].msg_hdr.msg_iov = &fleet->rx_iov[i];
+      fleet->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int received =
+        recvmmsg(fd, fleet->rx_msgs, FLEET_BATCH, MSG_DONTWAIT, NULL);
+    if (received < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    for (int i = 0; i < received; i++) {
+      size_t length = fleet->rx_msgs[i].msg_len;
+      if (length > 0)
+        completed += _dispatch(fleet, fd, &fleet->rx_addrs[i],
+                               fleet->rx_buffers[i], length);
+    }
+
+    if (received < FLEET_BATCH)
+      break;
+  }
+  fleet->rx_depth--;
+
+  return completed;
+}
+
+#ifdef CWIZ_IO_URING
+static int _ring_arm_recv(wiz_fleet_t *fleet, int k) {
+  return wiz_uring_recv_multishot(fleet->ring, fleet->sockets[k],
+                                  &fleet->ring_rx_msg,
+                                  FLEET_TAG_RECV | (uint64_t)k);
+}
+
+static void _ring_send_done(wiz_fleet_t *fleet, int index, int res) {
+  fleet_tx_t *tx = &fleet->tx[index];
+  fleet_request_t *req = &fleet->requests[tx->slot];
+
+  // a refused datagram fails the request from its timer, unless the request
+  // moved on (answered, retransmitted or completed) in the meantime
+  if (res < 0 && res != -EAGAIN && res != -EINTR && req->in_use &&
+      req->timer_gen == tx->gen)
+    _arm(fleet, tx->slot, WIZ_ERR_SOCKET, wiz_now_ms());
+
+  tx->next = fleet->tx_free;
+  fleet->tx_free = index;
+  fleet->tx_inflight--;
+}
+
+// one multishot completion: io_uring_recvmsg_out header, then the source
+// address, then the payload, all inside a provided buffer
+static int _ring_recv_done(wiz_fleet_t *fleet, int k, int res,
+                           unsigned int flags) {
+  int completed = 0;
+
+  if (res >= 0 && (flags & IORING_CQE_F_BUFFER)) {
+    unsigned int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    char *buffer = wiz_uring_buffer(fleet->ring, bid);
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buffer;
+    size_t header = sizeof(*out) + fleet->ring_rx_msg.msg_namelen;
+    size_t room = FLEET_RX_SIZE - header - 1; // keep a byte for the NUL
+    size_t length = out->payloadlen < room ? out->payloadlen : room;
+
+    if (out->namelen >= sizeof(struct sockaddr_in) && length > 0) {
+      struct sockaddr_in from;
+      memcpy(&from, buffer + sizeof(*out), sizeof(from));
+      completed = _dispatch(fleet, fleet->sockets[k], &from, buffer + header,
+                            length);
+    }
+    wiz_uring_recycle(fleet->ring, bid);
+  }
+
+  // the kernel stops a multishot receive when it runs out of buffers; start
+  // a new one. Any other error (e.g. a kernel without multishot recvmsg), or
+  // no room in the ring to re-arm, hands the socket back to epoll and
+  // recvmmsg so it is never left without a reader.
+  if (!(flags & IORING_CQE_F_MORE)) {
+    bool rearm = res >= 0 || res == -ENOBUFS || res == -EINTR;
+    if (!rearm || _ring_arm_recv(fleet, k) != WIZ_OK)
+      _watch_socket(fleet, fleet->sockets[k]);
+  }
+
+  return completed;
+}
+
+// drain the completion queue; each entry is consumed before its callback
+// runs, so callbacks may poll the fleet again
+static int _ring_reap(wiz_fleet_t *fleet) {
+  int completed = 0;
+  struct io_uring_cqe *cqe;
+
+  while ((cqe = wiz_uring_peek_cqe(fleet->ring)) != NULL) {
+    uint64_t tag = cqe->user_data;
+    int res = cqe->res;
+    unsigned int flags = cqe->flags;
+    wiz_uring_cqe_seen(fleet->ring);
+
+    int index = (int)(tag & 0xffffffffu);
+    if ((tag & ~0xffffffffULL) == FLEET_TAG_SEND)
+      _ring_send_done(fleet, index, res);
+    else if ((tag & ~0xffffffffULL) == FLEET_TAG_RECV)
+      completed += _ring_recv_done(fleet, index, res, flags);
+  }
+
+  // re-armed receives
+  wiz_uring_submit(fleet->ring, 0);
+  return completed;
+}
+
+// route pool sockets through a ring; on failure the fleet keeps using epoll
+// with sendmmsg/recvmmsg
+static void _ring_setup(wiz_fleet_t *fleet) {
+  fleet->ring = wiz_uring_create(FLEET_RING_ENTRIES, FLEET_RING_CQ_ENTRIES);
+  if (!fleet->ring)
+    return;
+
+  fleet->tx_free = -1;
+  for (int i = FLEET_RING_TX - 1; i >= 0; i--) {
+    fleet->tx[i].next = fleet->tx_free;
+    fleet->tx_free = i;
+  }
+
+  fleet->ring_rx_msg.msg_namelen = sizeof(struct sockaddr_in);
+
+  bool ok = wiz_uring_setup_buffers(fleet->ring, 0, FLEET_RING_BUFFERS,
+                                    FLEET_RX_SIZE) == WIZ_OK &&
+            _watch_socket(fleet, wiz_uring_fd(fleet->ring)) == WIZ_OK;
+  for (int k = 0; ok && k < fleet->socket_count; k++)
+    ok = _ring_arm_recv(fleet, k) == WIZ_OK;
+  if (ok)
+    ok = wiz_uring_submit(fleet->ring, 0) >= 0;
+
+  if (!ok) {
+    epoll_ctl(fleet->epoll_fd, EPOLL_CTL_DEL, wiz_uring_fd(fleet->ring), NULL);
+    wiz_uring_destroy(fleet->ring);
+    fleet->ring = NULL;
+  }
+}
+
+static void _ring_destroy(wiz_fleet_t *fleet) {
+  // the kernel may still read queued datagrams; wait for their completions
+  while (fleet->tx_inflight > 0) {
+    struct io_uring_cqe *cqe = wiz_uring_peek_cqe(fleet->ring);
+    if (!cqe) {
+      if (wiz_uring_submit(fleet->ring, 1) < 0)
+        break;
+      continue;
+    }
+    uint64_t tag = cqe->user_data;
+    wiz_uring_cqe_seen(fleet->ring);
+    if ((tag & ~0xffffffffULL) == FLEET_TAG_SEND)
+      fleet->tx_inflight--;
+  }
+  wiz_uring_destroy(fleet->ring);
+}
+#endif
+
+static int _expire_timers(wiz_fleet_t *fleet, uint64_t now) {
+  int completed = 0;
+
+  for (;;) {
+    _timer_prune(fleet);
+    if (fleet->timer_count == 0 || fleet->timers[0].deadline_ms > now)
+      break;
+
+    int slot = fleet->timers[0].slot;
+    _timer_pop(fleet);
+
+    fleet_request_t *req = &fleet->requests[slot];
+    if (req->send_error == WIZ_OK)
+      WIZ_TRACE(WIZ_TRACE_TIMEOUT, &req->bulb->addr, req->message,
+                req->attempts, WIZ_ERR_TIMEOUT);
+    req->timer_gen++;
+    req->attempts++;
+    if (req->send_error != WIZ_OK) {
+      _complete(fleet, slot, req->send_error);
+      completed++;
+    } else if (req->attempts >= WIZ_MAX_RETRIES) {
+      wiz_rtt_reset(&req->bulb->rtt);
+      _complete(fleet, slot, WIZ_ERR_TIMEOUT);
+      completed++;
+    } else if (req->deadline_ms && now >= req->deadline_ms) {
+      // the caller's deadline says nothing about the bulb, keep its RTT
+      _complete(fleet, slot, WIZ_ERR_TIMEOUT);
+      completed++;
+    } else {
+      _queue_send(fleet, slot);
+    }
+  }
+
+  return completed;
+}
+
+wiz_fleet_t *wiz_fleet_create(void) {
+  return wiz_fleet_create_pool(0);
+}
+
+wiz_fleet_t *wiz_fleet_create_pool(int socket_count) {
+  if (socket_count < 0 || socket_count > WIZ_FLEET_MAX_SOCKETS)
+    return NULL;
+
+  wiz_fleet_t *fleet = (wiz_fleet_t *)calloc(1, sizeof(wiz_fleet_t));
+  if (!fleet)
+    return NULL;
+
+  static uint32_t next_fleet_id = 1;
+  fleet->id = __atomic_fetch_add(&next_fleet_id, 1, __ATOMIC_RELAXED);
+  fleet->free_head = -1;
+  fleet->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (fleet->epoll_fd < 0) {
+    free(fleet);
+    return NULL;
+  }
+
+  uint32_t index_size = 64;
+  fleet->index_keys = (uint64_t *)malloc(index_size * sizeof(uint64_t));
+  fleet->index_slots = (int *)malloc(index_size * sizeof(int));
+  if (!fleet->index_keys || !fleet->index_slots) {
+    wiz_fleet_destroy(fleet);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < index_size; i++)
+    fleet->index_slots[i] = -1;
+  fleet->index_mask = index_size - 1;
+
+  for (int i = 0; i < socket_count; i++) {
+    int sock = wiz_create_socket();
+    if (sock < 0) {
+      wiz_fleet_destroy(fleet);
+      return NULL;
+    }
+    fleet->sockets[fleet->socket_count++] = sock;
+
+    // many bulbs answer into this socket at once; best effort only
+    int buffer_size = FLEET_SOCKET_BUFFER;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+  }
+
+#ifdef CWIZ_IO_URING
+  if (socket_count > 0)
+    _ring_setup(fleet);
+  if (fleet->ring)
+    return fleet;
+#endif
+
+  for (int i = 0; i < fleet->socket_count; i++) {
+    if (_watch_socket(fleet, fleet->sockets[i]) != WIZ_OK) {
+      wiz_fleet_destroy(fleet);
+      return NULL;
+    }
+  }
+
+  return fleet;
+}
+
+void wiz_fleet_destroy(wiz_fleet_t *fleet) {
+  if (!fleet)
+    return;
+
+#ifdef CWIZ_IO_URING
+  if (fleet->ring)
+    _ring_destroy(fleet);
+#endif
+  if (fleet->epoll_fd >= 0)
+    close(fleet->epoll_fd);
+  for (int i = 0; i < fleet->socket_count; i++)
+    close(fleet->sockets[i]);
+  free(fleet->requests);
+  free(fleet->send_queue);
+  free(fleet->index_keys);
+  free(fleet->index_slots);
+  free(fleet->timers);
+  free(fleet);
+}
+
+int wiz_fleet_apply_pilot(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                          const wiz_pilot_builder_t *builder,
+                          wiz_callback_t callback, void *user_data) {
+  if (!fleet || !bulb || !builder)
+    return WIZ_ERR_INVALID_PARAM;
+
+  return _submit(fleet, bulb, FLEET_SET_PILOT, builder, NULL, NULL, NULL, 0,
+                 callback, user_data, 0);
+}
+
+int wiz_fleet_update_state(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                           wiz_callback_t callback, void *user_data) {
+  if (!fleet || !bulb)
+    return WIZ_ERR_INVALID_PARAM;
+
+  return _submit(fleet, bulb, FLEET_GET_PILOT, NULL, NULL, NULL, NULL, 0,
+                 callback, user_data, 0);
+}
+
+// queue a compiled setPilot; the request copies the datagram and stamps its
+// own id, so the message may be destroyed as soon as this returns
+int wiz_fleet_send_pilot(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                         const wiz_pilot_message_t *message,
+                         wiz_callback_t callback, void *user_data) {
+  if (!fleet || !bulb || !message)
+    return WIZ_ERR_INVALID_PARAM;
+
+  return _submit(fleet, bulb, FLEET_SET_PILOT, NULL, message, NULL, NULL, 0,
+                 callback, user_data, 0);
+}
+
+// fan one builder out to many bulbs; the payload is serialized once and the
+// datagrams leave in sendmmsg batches on the next poll. Returns the number of
+// requests queued.
+int wiz_fleet_apply_pilot_many(wiz_fleet_t *fleet, wiz_bulb_t **bulbs,
+                               int count, const wiz_pilot_builder_t *builder,
+                               wiz_callback_t callback, void *user_data) {
+  if (!fleet || !bulbs || count < 0 || !builder)
+    return WIZ_ERR_INVALID_PARAM;
+
+  wiz_pilot_message_t *message = wiz_pilot_builder_compile(builder);
+  if (!message)
+    return WIZ_ERR_MALLOC;
+
+  int queued = 0;
+  int ret = WIZ_OK;
+  for (int i = 0; i < count; i++) {
+    if (!bulbs[i])
+      continue;
+    ret = wiz_fleet_send_pilot(fleet, bulbs[i], message, callback,
+                                 user_data);
+    if (ret != WIZ_OK)
+      break;
+    queued++;
+  }
+
+  wiz_pilot_message_destroy(message);
+  return queued > 0 || ret == WIZ_OK ? queued : ret;
+}
+
+// windowed state refresh: at most `window` of these getPilot requests are in
+// flight at once, each finished one starts the next
+typedef struct {
+  wiz_fleet_t *fleet;
+  wiz_bulb_t **bulbs;
+  int count;
+  int next; // first bulb not yet submitted
+  int in_flight;
+  int window;
+  uint64_t deadline_ms;
+  int succeeded;
+  wiz_callback_t callback;
+  void *user_data;
+} fleet_poll_t;
+
+static void _poll_done(wiz_bulb_t *bulb, int result,
+                       const wiz_bulb_state_t *state, void *user_data);
+
+static void _poll_fill(fleet_poll_t *poll) {
+  while (poll->in_flight < poll->window && poll->next < poll->count) {
+    wiz_bulb_t *bulb = poll->bulbs[poll->next++];
+    if (!bulb)
+      continue;
+
+    // past the deadline the rest are reported without being sent
+    int ret = WIZ_ERR_TIMEOUT;
+    if (wiz_now_ms() < poll->deadline_ms)
+      ret = _submit(poll->fleet, bulb, FLEET_GET_PILOT, NULL, NULL, NULL,
+                    NULL, 0, _poll_done, poll, poll->deadline_ms);
+    if (ret == WIZ_OK) {
+      poll->in_flight++;
+    } else if (poll->callback) {
+      poll->callback(bulb, ret, &bulb->state, poll->user_data);
+    }
+  }
+}
+
+static void _poll_done(wiz_bulb_t *bulb, int result,
+                       const wiz_bulb_state_t *state, void *user_data) {
+  fleet_poll_t *poll = (fleet_poll_t *)user_data;
+
+  poll->in_flight--;
+  if (result == WIZ_OK)
+    poll->succeeded++;
+  if (poll->callback)
+    poll->callback(bulb, result, state, poll->user_data);
+
+  _poll_fill(poll);
+}
+
+// refresh the state of many bulbs with at most `window` requests in flight,
+// reporting each bulb to callback as it finishes. Bulbs still unanswered after
+// timeout_ms complete with WIZ_ERR_TIMEOUT. Returns the number refreshed.
+int wiz_fleet_poll_state(wiz_fleet_t *fleet, wiz_bulb_t **bulbs, int count,
+                         int window, int timeout_ms, wiz_callback_t callback,
+                         void *user_data) {
+  if (!fleet || !bulbs || count < 0 || window <= 0 || timeout_ms < 0)
+    return WIZ_ERR_INVALID_PARAM;
+
+  fleet_poll_t poll = {
+      .fleet = fleet,
+      .bulbs = bulbs,
+      .count = count,
+      .window = window,
+      .deadline_ms = wiz_now_ms() + (uint64_t)timeout_ms,
+      .callback = callback,
+      .user_data = user_data,
+  };
+
+  _poll_fill(&poll);
+
+  while (poll.in_flight > 0) {
+    int ret = wiz_fleet_poll(fleet, -1);
+    if (ret < 0) {
+      // detach from the stack frame before giving up on the requests
+      for (int i = 0; i < fleet->capacity; i++) {
+        if (fleet->requests[i].in_use &&
+            fleet->requests[i].user_data == &poll)
+          fleet->requests[i].callback = NULL;
+      }
+      return ret;
+    }
+  }
+
+  return poll.succeeded;
+}
+
+int wiz_fleet_pending(wiz_fleet_t *fleet) {
+  if (!fleet)
+    return WIZ_ERR_INVALID_PARAM;
+
+  return fleet->active;
+}
+
+// send queued datagrams, wait up to timeout_ms (-1 = until the next retransmit
+// deadline) for replies, and fire callbacks; returns the number completed
+int wiz_fleet_poll(wiz_fleet_t *fleet, int timeout_ms) {
+  if (!fleet)
+    return WIZ_ERR_INVALID_PARAM;
+
+  _flush_sends(fleet);
+
+  _timer_prune(fleet);
+  if (fleet->timer_count > 0) {
+    uint64_t now = wiz_now_ms();
+    uint64_t deadline = fleet->timers[0].deadline_ms;
+    int until = deadline > now ? (int)(deadline - now) : 0;
+    if (timeout_ms < 0 || until < timeout_ms)
+      timeout_ms = until;
+  } else if (fleet->active == 0 && timeout_ms < 0) {
+    return 0;
+  }
+
+  struct epoll_event events[FLEET_MAX_EVENTS];
+  int ready = epoll_wait(fleet->epoll_fd, events, FLEET_MAX_EVENTS, timeout_ms);
+  if (ready < 0 && errno != EINTR)
+    return WIZ_ERR_SOCKET;
+
+  int completed = 0;
+  for (int i = 0; i < ready; i++) {
+#ifdef CWIZ_IO_URING
+    if (fleet->ring && events[i].data.fd == wiz_uring_fd(fleet->ring)) {
+      completed += _ring_reap(fleet);
+      continue;
+    }
+#endif
+    completed += _read_socket(fleet, events[i].data.fd);
+  }
+
+  completed += _expire_timers(fleet, wiz_now_ms());
+  _flush_sends(fleet);
+
+  return completed;
+}
+
+int wiz_fleet_get_fd(wiz_fleet_t *fleet) {
+  if (!fleet)
+    return WIZ_ERR_INVALID_PARAM;
+
+  return fleet->epoll_fd;
+}
+
+// milliseconds until wiz_process_events() has timer work to do, 0 when sends
+// are queued, -1 when nothing is outstanding
+int wiz_fleet_next_timeout(wiz_fleet_t *fleet) {
+  if (!fleet)
+    return WIZ_ERR_INVALID_PARAM;
+
+  if (fleet->send_count > 0)
+    return 0;
+
+  _timer_prune(fleet);
+  if (fleet->timer_count == 0)
+    return -1;
+
+  uint64_t now = wiz_now_ms();
+  uint64_t deadline = fleet->timers[0].deadline_ms;
+  return deadline > now ? (int)(deadline - now) : 0;
+}
+
+int wiz_process_events(wiz_fleet_t *fleet) {
+  return wiz_fleet_poll(fleet, 0);
+}
+
+int wiz_fleet_run(wiz_fleet_t *fleet) {
+  if (!fleet)
+    return WIZ_ERR_INVALID_PARAM;
+
+  while (fleet->active > 0) {
+    int ret = wiz_fleet_poll(fleet, -1);
+    if (ret < 0)
+      return ret;
+  }
+
+  return WIZ_OK;
+}
+
+// pick the pool socket for a bulb; spreading by address keeps each socket's
+// receive queue roughly the same size
+int wiz_fleet_shared_socket(wiz_fleet_t *fleet,
+                            const struct sockaddr_in *addr) {
+  if (!fleet || !addr || fleet->socket_count == 0)
+    return WIZ_ERR_INVALID_PARAM;
+
+  return fleet->sockets[_hash_key(_addr_key(addr)) % fleet->socket_count];
+}
+
+static void _exchange_done(wiz_bulb_t *bulb, int result,
+                           const wiz_bulb_state_t *state, void *user_data) {
+  (void)bulb;
+  (void)state;
+  *(int *)user_data = result;
+}
+
+// blocking exchange for bulbs on a shared socket; other requests on the fleet
+// keep making progress while this one waits
+int wiz_fleet_exchange(wiz_fleet_t *fleet, wiz_bulb_t *bulb,
+                       const char *message, char *response,
+                       size_t response_size) {
+  if (!fleet || !bulb || !message || !response || response_size == 0)
+    return WIZ_ERR_INVALID_PARAM;
+
+  int result = 1; // any wiz_error_t is <= 0
+  int ret = _submit(fleet, bulb, FLEET_EXCHANGE, NULL, NULL, message,
+                    response, response_size, _exchange_done, &result, 0);
+  if (ret != WIZ_OK)
+    return ret;
+
+  while (result > 0) {
+    ret = wiz_fleet_poll(fleet, -1);
+    if (ret < 0) {
+      // detach from the stack frame before giving up on the request
+      for (int i = 0; i < fleet->capacity; i++) {
+        if (fleet->requests[i].in_use &&
+            fleet->requests[i].user_data == &result) {
+          fleet->requests[i].callback = NULL;
+          fleet->requests[i].reply = NULL;
+        }
+      }
+      return ret;
+    }
+  }
+
+  return result;
+}
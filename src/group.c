@@ -0,0 +1,335 @@
+#include "../include/cwiz.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define GROUP_PENDING 1     // any wiz_error_t is <= 0
+#define GROUP_NOT_APPLIED 2 // added since the last apply
+
+typedef struct group_apply group_apply_t;
+
+// user data of one member's request
+typedef struct {
+  group_apply_t *apply;
+  int index;
+} group_member_t;
+
+// one fan-out in flight; freed by its last completion, or by the blocking
+// call that waits for it
+struct group_apply {
+  wiz_group_t *group; // NULL once the group is destroyed
+  int remaining;
+  int acked;
+  bool blocking;
+  wiz_callback_t callback;
+  void *user_data;
+  group_apply_t *next;
+  group_member_t members[];
+};
+
+struct wiz_group {
+  wiz_bulb_t **members;
+  int *results; // last result per member, GROUP_PENDING while in flight or
+                // GROUP_NOT_APPLIED before the member's first apply
+  int count;
+  int capacity;
+  group_apply_t *applies; // in flight; membership is fixed until they finish
+  wiz_fleet_t *fleet;     // for the blocking calls, created on first use
+};
+
+wiz_group_t *wiz_group_create(void) {
+  return (wiz_group_t *)calloc(1, sizeof(wiz_group_t));
+}
+
+void wiz_group_destroy(wiz_group_t *group) {
+  if (!group)
+    return;
+
+  // requests still queued on a caller's fleet complete without the group
+  for (group_apply_t *apply = group->applies; apply; apply = apply->next)
+    apply->group = NULL;
+
+  wiz_fleet_destroy(group->fleet);
+  free(group->members);
+  free(group->results);
+  free(group);
+}
+
+int wiz_group_add(wiz_group_t *group, wiz_bulb_t *bulb) {
+  if (!group || !bulb || group->applies)
+    return WIZ_ERR_INVALID_PARAM;
+
+  for (int i = 0; i < group->count; i++) {
+    if (group->members[i] == bulb)
+      return WIZ_OK;
+  }
+
+  if (group->count == group->capacity) {
+    int capacity = group->capacity ? group->capacity * 2 : 16;
+    wiz_bulb_t **members = (wiz_bulb_t **)realloc(
+        group->members, (size_t)capacity * sizeof(wiz_bulb_t *));
+    if (!members)
+      return WIZ_ERR_MALLOC;
+    group->members = members;
+
+    int *results =
+        (int *)realloc(group->results, (size_t)capacity * sizeof(int));
+    if (!results)
+      return WIZ_ERR_MALLOC;
+    group->results = results;
+    group->capacity = capacity;
+  }
+
+  group->members[group->count] = bulb;
+  group->results[group->count] = GROUP_NOT_APPLIED;
+  group->count++;
+  return WIZ_OK;
+}
+
+int wiz_group_remove(wiz_group_t *group, wiz_bulb_t *bulb) {
+  if (!group || !bulb || group->applies)
+    return WIZ_ERR_INVALID_PARAM;
+
+  for (int i = 0; i < group->count; i++) {
+    if (group->members[i] != bulb)
+      continue;
+    group->count--;
+    memmove(&group->members[i], &group->members[i + 1],
+            (size_t)(group->count - i) * sizeof(wiz_bulb_t *));
+    memmove(&group->results[i], &group->results[i + 1],
+            (size_t)(group->count - i) * sizeof(int));
+    return WIZ_OK;
+  }
+
+  return WIZ_ERR_INVALID_PARAM;
+}
+
+int wiz_group_count(const wiz_group_t *group) {
+  if (!group)
+    return WIZ_ERR_INVALID_PARAM;
+
+  return group->count;
+}
+
+wiz_bulb_t *wiz_group_get(const wiz_group_t *group, int index) {
+  if (!group || index < 0 || index >= group->count)
+    return NULL;
+
+  return group->members[index];
+}
+
+// outcome of the member's last apply: WIZ_OK when it acked, otherwise the
+// error its request finished with. A member that no apply has reached yet,
+// or whose request is still in flight, has no response.
+int wiz_group_result(const wiz_group_t *group, int index) {
+  if (!group || index < 0 || index >= group->count)
+    return WIZ_ERR_INVALID_PARAM;
+
+  int result = group->results[index];
+  return result > 0 ? WIZ_ERR_NO_RESPONSE : result;
+}
+
+static void _unlink(wiz_group_t *group, group_apply_t *apply) {
+  for (group_apply_t **p = &group->applies; *p; p = &(*p)->next) {
+    if (*p == apply) {
+      *p = apply->next;
+      return;
+    }
+  }
+}
+
+// a member finished; the fleet already committed the fields to its cached
+// state if it acked
+static void _member_done(wiz_bulb_t *bulb, int result,
+                         const wiz_bulb_state_t *state, void *user_data) {
+  group_member_t *member = (group_member_t *)user_data;
+  group_apply_t *apply = member->apply;
+  wiz_callback_t callback = apply->callback;
+  void *callback_data = apply->user_data;
+
+  if (apply->group)
+    apply->group->results[member->index] = result;
+  if (result == WIZ_OK)
+    apply->acked++;
+
+  // the callback may start the next apply on this group, so the finished one
+  // is retired first
+  bool last = --apply->remaining == 0 && !apply->blocking;
+  if (last) {
+    if (apply->group)
+      _unlink(apply->group, apply);
+    free(apply);
+  }
+
+  if (callback)
+    callback(bulb, result, state, callback_data);
+}
+
+// queue the message for every member; returns the apply with one pending
+// request per member that was queued
+static group_apply_t *_start(wiz_group_t *group, wiz_fleet_t *fleet,
+                             const wiz_pilot_message_t *message,
+                             bool blocking,
+                             wiz_callback_t callback, void *user_data) {
+  group_apply_t *apply = (group_apply_t *)malloc(
+      sizeof(group_apply_t) + (size_t)group->count * sizeof(group_member_t));
+  if (!apply)
+    return NULL;
+
+  apply->group = group;
+  apply->remaining = 0;
+  apply->acked = 0;
+  apply->blocking = blocking;
+  apply->callback = callback;
+  apply->user_data = user_data;
+  apply->next = group->applies;
+  group->applies = apply;
+
+  for (int i = 0; i < group->count; i++) {
+    group_member_t *member = &apply->members[i];
+    member->apply = apply;
+    member->index = i;
+
+    // every request copies the one message and stamps its own id
+    int ret = wiz_fleet_send_pilot(fleet, group->members[i], message,
+                                     _member_done, member);
+    if (ret == WIZ_OK) {
+      group->results[i] = GROUP_PENDING;
+      apply->remaining++;
+      continue;
+    }
+
+    group->results[i] = ret;
+    if (callback)
+      callback(group->members[i], ret, &group->members[i]->state, user_data);
+  }
+
+  return apply;
+}
+
+// send a compiled pilot to every member on the caller's fleet; callback
+// reports each member as it finishes. Returns the number of members queued.
+int wiz_group_send_pilot_async(wiz_fleet_t *fleet, wiz_group_t *group,
+                               const wiz_pilot_message_t *message,
+                               wiz_callback_t callback, void *user_data) {
+  if (!fleet || !group || !message)
+    return WIZ_ERR_INVALID_PARAM;
+
+  group_apply_t *apply =
+      _start(group, fleet, message, false, callback, user_data);
+  if (!apply)
+    return WIZ_ERR_MALLOC;
+
+  int queued = apply->remaining;
+  if (queued == 0) {
+    _unlink(group, apply);
+    free(apply);
+  }
+  return queued;
+}
+
+// the fleet a blocking send runs on: the fleet whose shared socket the members
+// were created from, or the group's own when they all have sockets of their
+// own. Members of two different fleets cannot be sent to in one call.
+static int _blocking_fleet(wiz_group_t *group, wiz_fleet_t **fleet) {
+  wiz_fleet_t *owner = NULL;
+  for (int i = 0; i < group->count; i++) {
+    wiz_fleet_t *member = group->members[i]->fleet;
+    if (!member)
+      continue;
+    if (owner && member != owner)
+      return WIZ_ERR_INVALID_PARAM;
+    owner = member;
+  }
+
+  if (owner) {
+    *fleet = owner;
+    return WIZ_OK;
+  }
+
+  if (!group->fleet) {
+    group->fleet = wiz_fleet_create();
+    if (!group->fleet)
+      return WIZ_ERR_SOCKET;
+  }
+  *fleet = group->fleet;
+  return WIZ_OK;
+}
+
+// send a compiled pilot to every member and wait until all of them acked or
+// gave up; per-member outcomes are left in wiz_group_result(). Returns the
+// number that acked.
+int wiz_group_send_pilot(wiz_group_t *group,
+                         const wiz_pilot_message_t *message) {
+  if (!group || !message)
+    return WIZ_ERR_INVALID_PARAM;
+
+  wiz_fleet_t *fleet;
+  int ret = _blocking_fleet(group, &fleet);
+  if (ret != WIZ_OK)
+    return ret;
+
+  group_apply_t *apply = _start(group, fleet, message, true, NULL, NULL);
+  if (!apply)
+    return WIZ_ERR_MALLOC;
+
+  while (apply->remaining > 0) {
+    ret = wiz_fleet_poll(fleet, -1);
+    if (ret < 0)
+      break;
+  }
+
+  if (ret < 0 && fleet != group->fleet) {
+    // the owning fleet keeps the requests; they finish the apply as if it
+    // had been started with the async form
+    apply->blocking = false;
+    return ret;
+  }
+
+  if (ret < 0) {
+    // the group's own fleet goes with its requests, so nothing completes
+    // later
+    wiz_fleet_destroy(group->fleet);
+    group->fleet = NULL;
+    for (int i = 0; i < group->count; i++) {
+      if (group->results[i] == GROUP_PENDING)
+        group->results[i] = ret;
+    }
+  }
+
+  int acked = apply->acked;
+  _unlink(group, apply);
+  free(apply);
+  return ret < 0 ? ret : acked;
+}
+
+// set every member from one builder; the payload is serialized once and
+// shared by all requests
+int wiz_group_apply_pilot(wiz_group_t *group,
+                          const wiz_pilot_builder_t *builder) {
+  if (!group || !builder)
+    return WIZ_ERR_INVALID_PARAM;
+
+  wiz_pilot_message_t *message = wiz_pilot_builder_compile(builder);
+  if (!message)
+    return WIZ_ERR_MALLOC;
+
+  int ret = wiz_group_send_pilot(group, message);
+  wiz_pilot_message_destroy(message);
+  return ret;
+}
+
+int wiz_group_apply_pilot_async(wiz_fleet_t *fleet, wiz_group_t *group,
+                                const wiz_pilot_builder_t *builder,
+                                wiz_callback_t callback, void *user_data) {
+  if (!fleet || !group || !builder)
+    return WIZ_ERR_INVALID_PARAM;
+
+  wiz_pilot_message_t *message = wiz_pilot_builder_compile(builder);
+  if (!message)
+    return WIZ_ERR_MALLOC;
+
+  int ret = wiz_group_send_pilot_async(fleet, group, message, callback,
+                                       user_data);
+  wiz_pilot_message_destroy(message);
+  return ret;
+}
@@ -0,0 +1,360 @@
+#include "../include/cwiz.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netpacket/packet.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern int wiz_parse_pilot_reply(const char *json, wiz_bulb_state_t *state,
+                                 wiz_bulb_info_t *info);
+extern int wiz_reply_matches(const char *request, const char *response);
+extern uint64_t wiz_now_ms(void);
+extern void wiz_state_confirm(wiz_bulb_t *bulb, unsigned int fields,
+                              wiz_source_t source);
+
+// unanswered registrations are retried from 1 s, doubling up to the
+// keep-alive interval
+#define LISTENER_FIRST_RETRY_MS 1000
+#define LISTENER_RX_SIZE 2048
+
+typedef struct {
+  wiz_bulb_t *bulb;
+  uint32_t s_addr;       // network order, sort key
+  uint64_t next_send_ms; // next registration
+  unsigned int backoff_ms;
+  bool awaiting;   // a registration is out and unanswered
+  bool registered; // the bulb answered the last registration
+} listener_entry_t;
+
+struct wiz_listener {
+  int socket_fd;
+  char message[256]; // registration, identical for every bulb
+  size_t message_len;
+
+  // sorted by address so a push finds its bulb by binary search
+  listener_entry_t *entries;
+  int count;
+  int capacity;
+  uint64_t next_due_ms; // earliest next_send_ms, UINT64_MAX when empty
+
+  wiz_push_callback_t callback;
+  void *user_data;
+};
+
+// fill in the address to advertise and the MAC of the interface carrying it;
+// a mock MAC is kept when the platform does not expose one
+static void _local_identity(char *ip_str, char *mac_str) {
+  struct ifaddrs *ifaddr, *ifa;
+  char ifname[IF_NAMESIZE] = "";
+
+  if (getifaddrs(&ifaddr) == -1)
+    return;
+
+  for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+    if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET)
+      continue;
+    if ((ifa->ifa_flags & IFF_LOOPBACK) || !(ifa->ifa_flags & IFF_UP))
+      continue;
+
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr, addr,
+              sizeof(addr));
+    if (ip_str[0] == '\0')
+      strcpy(ip_str, addr);
+    if (strcmp(ip_str, addr) == 0) {
+      snprintf(ifname, sizeof(ifname), "%s", ifa->ifa_name);
+      break;
+    }
+  }
+
+  for (ifa = ifaddr; ifname[0] && ifa != NULL; ifa = ifa->ifa_next) {
+    if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_PACKET ||
+        strcmp(ifa->ifa_name, ifname) != 0)
+      continue;
+
+    struct sockaddr_ll *ll = (struct sockaddr_ll *)ifa->ifa_addr;
+    if (ll->sll_halen == 6) {
+      snprintf(mac_str, 13, "%02x%02x%02x%02x%02x%02x", ll->sll_addr[0],
+               ll->sll_addr[1], ll->sll_addr[2], ll->sll_addr[3],
+               ll->sll_addr[4], ll->sll_addr[5]);
+    }
+    break;
+  }
+
+  freeifaddrs(ifaddr);
+}
+
+static int _find(const wiz_listener_t *listener, uint32_t s_addr) {
+  int lo = 0, hi = listener->count - 1;
+  while (lo <= hi) {
+    int mid = lo + (hi - lo) / 2;
+    uint32_t key = listener->entries[mid].s_addr;
+    if (key == s_addr)
+      return mid;
+    if (key < s_addr)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  return -(lo + 1); // insertion point
+}
+
+static void _update_due(wiz_listener_t *listener) {
+  listener->next_due_ms = UINT64_MAX;
+  for (int i = 0; i < listener->count; i++) {
+    if (listener->entries[i].next_send_ms < listener->next_due_ms)
+      listener->next_due_ms = listener->entries[i].next_send_ms;
+  }
+}
+
+static void _send_registration(wiz_listener_t *listener,
+                               listener_entry_t *entry, uint64_t now) {
+  // a refused send is retried on the same schedule as a lost one
+  sendto(listener->socket_fd, listener->message, listener->message_len, 0,
+         (const struct sockaddr *)&entry->bulb->addr,
+         sizeof(entry->bulb->addr));
+
+  entry->awaiting = true;
+  entry->next_send_ms = now + entry->backoff_ms;
+  entry->backoff_ms *= 2;
+  if (entry->backoff_ms > WIZ_REGISTER_INTERVAL_MS)
+    entry->backoff_ms = WIZ_REGISTER_INTERVAL_MS;
+}
+
+// bind the push port and prepare the registration message; local_ip is the
+// address bulbs should push to, NULL for the first non-loopback interface
+wiz_listener_t *wiz_listener_create(const char *local_ip,
+                                    wiz_push_callback_t callback,
+                                    void *user_data) {
+  char ip_str[INET_ADDRSTRLEN] = "";
+  char mac_str[13] = "001122334455";
+  struct in_addr check;
+
+  if (local_ip) {
+    if (inet_pton(AF_INET, local_ip, &check) <= 0)
+      return NULL;
+    snprintf(ip_str, sizeof(ip_str), "%s", local_ip);
+  }
+  _local_identity(ip_str, mac_str);
+  if (ip_str[0] == '\0')
+    return NULL;
+
+  wiz_listener_t *listener =
+      (wiz_listener_t *)calloc(1, sizeof(wiz_listener_t));
+  if (!listener)
+    return NULL;
+
+  listener->callback = callback;
+  listener->user_data = user_data;
+  listener->next_due_ms = UINT64_MAX;
+
+  int len = snprintf(listener->message, sizeof(listener->message),
+    "{\"method\":\"registration\",\"params\":{\"phoneMac\":\"%s\",\"register\":true,\"phoneIp\":\"%s\",\"id\":\"1\"}}",
+    mac_str, ip_str);
+  listener->message_len = (size_t)len;
+
+  listener->socket_fd =
+      socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listener->socket_fd < 0) {
+    free(listener);
+    return NULL;
+  }
+
+  int reuse = 1;
+  setsockopt(listener->socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+             sizeof(reuse));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(WIZ_PUSH_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  if (bind(listener->socket_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(listener->socket_fd);
+    free(listener);
+    return NULL;
+  }
+
+  return listener;
+}
+
+void wiz_listener_destroy(wiz_listener_t *listener) {
+  if (!listener)
+    return;
+
+  close(listener->socket_fd);
+  free(listener->entries);
+  free(listener);
+}
+
+// start tracking a bulb; the first registration goes out on the next
+// wiz_listener_process() call
+int wiz_listener_add(wiz_listener_t *listener, wiz_bulb_t *bulb) {
+  if (!listener || !bulb)
+    return WIZ_ERR_INVALID_PARAM;
+
+  int pos = _find(listener, bulb->addr.sin_addr.s_addr);
+  if (pos >= 0) {
+    listener->entries[pos].bulb = bulb;
+    return WIZ_OK;
+  }
+  pos = -pos - 1;
+
+  if (listener->count == listener->capacity) {
+    int capacity = listener->capacity ? listener->capacity * 2 : 16;
+    listener_entry_t *entries = (listener_entry_t *)realloc(
+        listener->entries, (size_t)capacity * sizeof(listener_entry_t));
+    if (!entries)
+      return WIZ_ERR_MALLOC;
+    listener->entries = entries;
+    listener->capacity = capacity;
+  }
+
+  memmove(&listener->entries[pos + 1], &listener->entries[pos],
+          (size_t)(listener->count - pos) * sizeof(listener_entry_t));
+  listener->count++;
+
+  listener_entry_t *entry = &listener->entries[pos];
+  memset(entry, 0, sizeof(*entry));
+  entry->bulb = bulb;
+  entry->s_addr = bulb->addr.sin_addr.s_addr;
+  entry->next_send_ms = wiz_now_ms();
+  entry->backoff_ms = LISTENER_FIRST_RETRY_MS;
+  listener->next_due_ms = entry->next_send_ms;
+
+  return WIZ_OK;
+}
+
+// stop tracking a bulb; it keeps pushing until its registration lapses
+int wiz_listener_remove(wiz_listener_t *listener, wiz_bulb_t *bulb) {
+  if (!listener || !bulb)
+    return WIZ_ERR_INVALID_PARAM;
+
+  int pos = _find(listener, bulb->addr.sin_addr.s_addr);
+  if (pos < 0 || listener->entries[pos].bulb != bulb)
+    return WIZ_ERR_INVALID_PARAM;
+
+  memmove(&listener->entries[pos], &listener->entries[pos + 1],
+          (size_t)(listener->count - pos - 1) * sizeof(listener_entry_t));
+  listener->count--;
+  _update_due(listener);
+  return WIZ_OK;
+}
+
+// number of tracked bulbs that answered their last registration
+int wiz_listener_registered(wiz_listener_t *listener) {
+  if (!listener)
+    return WIZ_ERR_INVALID_PARAM;
+
+  int registered = 0;
+  for (int i = 0; i < listener->count; i++)
+    registered += listener->entries[i].registered;
+  return registered;
+}
+
+int wiz_listener_get_fd(wiz_listener_t *listener) {
+  if (!listener)
+    return WIZ_ERR_INVALID_PARAM;
+
+  return listener->socket_fd;
+}
+
+// milliseconds until a registration is due, -1 when no bulb is tracked
+int wiz_listener_next_timeout(wiz_listener_t *listener) {
+  if (!listener)
+    return WIZ_ERR_INVALID_PARAM;
+  if (listener->next_due_ms == UINT64_MAX)
+    return -1;
+
+  uint64_t now = wiz_now_ms();
+  return listener->next_due_ms > now ? (int)(listener->next_due_ms - now) : 0;
+}
+
+// apply every queued push and send due registrations without blocking;
+// returns the number of pushes applied
+int wiz_listener_process(wiz_listener_t *listener) {
+  if (!listener)
+    return WIZ_ERR_INVALID_PARAM;
+
+  char buffer[LISTENER_RX_SIZE];
+  int pushes = 0;
+  bool renewed = false;
+
+  for (;;) {
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    ssize_t received = recvfrom(listener->socket_fd, buffer, sizeof(buffer) - 1,
+                                0, (struct sockaddr *)&from, &from_len);
+    if (received < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    buffer[received] = '\0';
+
+    int pos = _find(listener, from.sin_addr.s_addr);
+    if (pos < 0)
+      continue;
+    listener_entry_t *entry = &listener->entries[pos];
+    wiz_bulb_t *bulb = entry->bulb;
+
+    if (wiz_reply_matches("{\"method\":\"syncPilot\"}", buffer)) {
+      if (wiz_parse_pilot_reply(buffer, &bulb->state, &bulb->info) != WIZ_OK)
+        continue;
+      wiz_state_confirm(bulb, WIZ_FIELD_ALL, WIZ_SOURCE_PUSH);
+      pushes++;
+      if (listener->callback)
+        listener->callback(bulb, &bulb->state, listener->user_data);
+    } else if (wiz_reply_matches("{\"method\":\"registration\"}", buffer)) {
+      // registered: renew on the keep-alive interval from now on
+      entry->awaiting = false;
+      entry->registered = true;
+      entry->next_send_ms = wiz_now_ms() + WIZ_REGISTER_INTERVAL_MS;
+      renewed = true;
+    }
+  }
+
+  // a burst of answers moves many due times; the earliest is found once
+  // for all of them, not once per answer
+  if (renewed)
+    _update_due(listener);
+
+  uint64_t now = wiz_now_ms();
+  if (now >= listener->next_due_ms) {
+    for (int i = 0; i < listener->count; i++) {
+      listener_entry_t *entry = &listener->entries[i];
+      if (entry->next_send_ms > now)
+        continue;
+      if (entry->awaiting)
+        entry->registered = false; // the last one went unanswered
+      else
+        entry->backoff_ms = LISTENER_FIRST_RETRY_MS; // renewal, retry soon
+      _send_registration(listener, entry, now);
+    }
+    _update_due(listener);
+  }
+
+  return pushes;
+}
+
+// wait up to timeout_ms (-1 for no limit) for pushes or due registrations
+int wiz_listener_poll(wiz_listener_t *listener, int timeout_ms) {
+  if (!listener)
+    return WIZ_ERR_INVALID_PARAM;
+
+  int until = wiz_listener_next_timeout(listener);
+  if (until >= 0 && (timeout_ms < 0 || until < timeout_ms))
+    timeout_ms = until;
+
+  struct pollfd pfd = {.fd = listener->socket_fd, .events = POLLIN};
+  if (poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR)
+    return WIZ_ERR_SOCKET;
+
+  return wiz_listener_process(listener);
+}
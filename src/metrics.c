@@ -0,0 +1,268 @@
+#include "../include/cwiz.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+// transport metrics: every counter lives twice, in the bulb (plain
+// increments, a bulb is only driven from one thread) and in a process-wide
+// total kept with relaxed atomics, since fleets may run on several threads
+
+static wiz_metrics_t global;
+
+#define GLOBAL_ADD(field, n)                                                   \
+  __atomic_fetch_add(&global.field, (n), __ATOMIC_RELAXED)
+
+// histogram bucket of a round trip: 0 for <= 1 ms, i for <= 2^i ms
+static int _rtt_bucket(uint32_t rtt_ms) {
+  if (rtt_ms <= 1)
+    return 0;
+  int bucket = 32 - __builtin_clz(rtt_ms - 1);
+  return bucket < WIZ_RTT_BUCKETS - 1 ? bucket : WIZ_RTT_BUCKETS - 1;
+}
+
+// a datagram of an exchange went out; attempt 0 starts the exchange
+void wiz_metrics_sent(wiz_bulb_t *bulb, size_t bytes, int attempt) {
+  if (attempt == 0) {
+    bulb->metrics.requests++;
+    GLOBAL_ADD(requests, 1);
+  } else if (attempt < WIZ_MAX_RETRIES) {
+    bulb->metrics.retransmits[attempt]++;
+    GLOBAL_ADD(retransmits[attempt], 1);
+  }
+  bulb->metrics.bytes_sent += bytes;
+  GLOBAL_ADD(bytes_sent, bytes);
+}
+
+// a datagram from the bulb arrived, wanted or not
+void wiz_metrics_received(wiz_bulb_t *bulb, size_t bytes) {
+  bulb->metrics.bytes_received += bytes;
+  GLOBAL_ADD(bytes_received, bytes);
+}
+
+void wiz_metrics_stale(wiz_bulb_t *bulb) {
+  bulb->replies.stale_replies++;
+  GLOBAL_ADD(stale_replies, 1);
+}
+
+void wiz_metrics_foreign(wiz_bulb_t *bulb) {
+  bulb->replies.foreign_replies++;
+  GLOBAL_ADD(foreign_replies, 1);
+}
+
+// a clean (never retransmitted) round trip
+void wiz_metrics_rtt(wiz_bulb_t *bulb, uint32_t rtt_ms) {
+  int bucket = _rtt_bucket(rtt_ms);
+  bulb->metrics.rtt_buckets[bucket]++;
+  bulb->metrics.rtt_count++;
+  bulb->metrics.rtt_sum_ms += rtt_ms;
+  GLOBAL_ADD(rtt_buckets[bucket], 1);
+  GLOBAL_ADD(rtt_count, 1);
+  GLOBAL_ADD(rtt_sum_ms, rtt_ms);
+}
+
+// an exchange finished with the given result
+void wiz_metrics_done(wiz_bulb_t *bulb, int result) {
+  if (result == WIZ_ERR_TIMEOUT) {
+    bulb->metrics.timeouts++;
+    GLOBAL_ADD(timeouts, 1);
+  } else if (result == WIZ_ERR_SOCKET) {
+    bulb->metrics.send_errors++;
+    GLOBAL_ADD(send_errors, 1);
+  } else {
+    bulb->metrics.replies++;
+    GLOBAL_ADD(replies, 1);
+  }
+}
+
+int wiz_bulb_get_metrics(const wiz_bulb_t *bulb, wiz_metrics_t *metrics) {
+  if (!bulb || !metrics) {
+    return WIZ_ERR_INVALID_PARAM;
+  }
+
+  *metrics = bulb->metrics;
+  metrics->stale_replies = bulb->replies.stale_replies;
+  metrics->foreign_replies = bulb->replies.foreign_replies;
+  metrics->srtt_ms = bulb->rtt.samples ? bulb->rtt.srtt >> 3 : 0;
+  return WIZ_OK;
+}
+
+// totals over every bulb since the process started
+int wiz_metrics_get_global(wiz_metrics_t *metrics) {
+  if (!metrics) {
+    return WIZ_ERR_INVALID_PARAM;
+  }
+
+  const uint64_t *src = (const uint64_t *)&global;
+  uint64_t *dst = (uint64_t *)metrics;
+  size_t words = offsetof(wiz_metrics_t, srtt_ms) / sizeof(uint64_t);
+  for (size_t i = 0; i < words; i++)
+    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+  metrics->srtt_ms = 0;
+  return WIZ_OK;
+}
+
+// prometheus text exposition
+
+typedef struct {
+  char *p;
+  size_t left;
+  size_t total;
+} prom_writer_t;
+
+static void _emit(prom_writer_t *w, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(w->p, w->left, fmt, args);
+  va_end(args);
+  if (n < 0)
+    return;
+
+  w->total += (size_t)n;
+  size_t used = (size_t)n < w->left ? (size_t)n : w->left;
+  w->p += used;
+  w->left -= used;
+}
+
+static const struct {
+  const char *name;
+  size_t offset;
+} counters[] = {
+    {"requests", offsetof(wiz_metrics_t, requests)},
+    {"replies", offsetof(wiz_metrics_t, replies)},
+    {"timeouts", offsetof(wiz_metrics_t, timeouts)},
+    {"send_errors", offsetof(wiz_metrics_t, send_errors)},
+    {"stale_replies", offsetof(wiz_metrics_t, stale_replies)},
+    {"foreign_replies", offsetof(wiz_metrics_t, foreign_replies)},
+    {"sent_bytes", offsetof(wiz_metrics_t, bytes_sent)},
+    {"received_bytes", offsetof(wiz_metrics_t, bytes_received)},
+};
+
+// the series of one prefix: the process-wide totals when bulbs is NULL,
+// otherwise one labelled series per bulb. Each family is written as one
+// contiguous block, as the exposition format requires.
+typedef struct {
+  const char *prefix;
+  wiz_bulb_t *const *bulbs;
+  int count;
+} prom_set_t;
+
+static int _set_size(const prom_set_t *set) {
+  return set->bulbs ? set->count : 1;
+}
+
+// metrics and label list (with a trailing comma when non-empty) of entry i;
+// false for NULL bulbs
+static bool _set_entry(const prom_set_t *set, int i, wiz_metrics_t *m,
+                       char *labels, size_t size) {
+  labels[0] = '\0';
+  if (!set->bulbs) {
+    wiz_metrics_get_global(m);
+    return true;
+  }
+
+  const wiz_bulb_t *bulb = set->bulbs[i];
+  if (!bulb)
+    return false;
+  wiz_bulb_get_metrics(bulb, m);
+  if (bulb->info.mac_address[0])
+    snprintf(labels, size, "ip=\"%s\",mac=\"%s\",", bulb->ip_address,
+             bulb->info.mac_address);
+  else
+    snprintf(labels, size, "ip=\"%s\",", bulb->ip_address);
+  return true;
+}
+
+// "{labels}" from a list with a trailing comma, or nothing
+static void _emit_labels(prom_writer_t *w, const char *labels) {
+  size_t len = strlen(labels);
+  if (len > 0)
+    _emit(w, "{%.*s}", (int)(len - 1), labels);
+}
+
+static void _emit_set(prom_writer_t *w, const prom_set_t *set) {
+  const char *prefix = set->prefix;
+  int n = _set_size(set);
+  wiz_metrics_t m;
+  char labels[96];
+
+  for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+    _emit(w, "# TYPE %s_%s_total counter\n", prefix, counters[c].name);
+    for (int i = 0; i < n; i++) {
+      if (!_set_entry(set, i, &m, labels, sizeof(labels)))
+        continue;
+      _emit(w, "%s_%s_total", prefix, counters[c].name);
+      _emit_labels(w, labels);
+      const uint64_t *value =
+          (const uint64_t *)((const char *)&m + counters[c].offset);
+      _emit(w, " %llu\n", (unsigned long long)*value);
+    }
+  }
+
+  _emit(w, "# TYPE %s_retransmits_total counter\n", prefix);
+  for (int i = 0; i < n; i++) {
+    if (!_set_entry(set, i, &m, labels, sizeof(labels)))
+      continue;
+    for (int a = 1; a < WIZ_MAX_RETRIES; a++)
+      _emit(w, "%s_retransmits_total{%sattempt=\"%d\"} %llu\n", prefix,
+            labels, a, (unsigned long long)m.retransmits[a]);
+  }
+
+  // prometheus buckets are cumulative
+  _emit(w, "# TYPE %s_rtt_milliseconds histogram\n", prefix);
+  for (int i = 0; i < n; i++) {
+    if (!_set_entry(set, i, &m, labels, sizeof(labels)))
+      continue;
+    uint64_t cumulative = 0;
+    for (int b = 0; b < WIZ_RTT_BUCKETS; b++) {
+      cumulative += m.rtt_buckets[b];
+      if (b < WIZ_RTT_BUCKETS - 1)
+        _emit(w, "%s_rtt_milliseconds_bucket{%sle=\"%u\"} %llu\n", prefix,
+              labels, 1u << b, (unsigned long long)cumulative);
+      else
+        _emit(w, "%s_rtt_milliseconds_bucket{%sle=\"+Inf\"} %llu\n", prefix,
+              labels, (unsigned long long)cumulative);
+    }
+    _emit(w, "%s_rtt_milliseconds_sum", prefix);
+    _emit_labels(w, labels);
+    _emit(w, " %llu\n", (unsigned long long)m.rtt_sum_ms);
+    _emit(w, "%s_rtt_milliseconds_count", prefix);
+    _emit_labels(w, labels);
+    _emit(w, " %llu\n", (unsigned long long)m.rtt_count);
+  }
+
+  if (!set->bulbs)
+    return;
+  _emit(w, "# TYPE %s_srtt_milliseconds gauge\n", prefix);
+  for (int i = 0; i < n; i++) {
+    if (!_set_entry(set, i, &m, labels, sizeof(labels)))
+      continue;
+    _emit(w, "%s_srtt_milliseconds", prefix);
+    _emit_labels(w, labels);
+    _emit(w, " %u\n", m.srtt_ms);
+  }
+}
+
+// render the process-wide totals as wiz_* and, for each given bulb, its own
+// counters as wiz_bulb_*{ip="..."}; returns the length of the full text,
+// which was truncated if it is not smaller than size
+int wiz_metrics_write_prometheus(char *buffer, size_t size,
+                                 wiz_bulb_t *const *bulbs, int count) {
+  if ((!buffer && size > 0) || (!bulbs && count > 0) || count < 0) {
+    return WIZ_ERR_INVALID_PARAM;
+  }
+
+  prom_writer_t w = {buffer, size, 0};
+  if (size > 0)
+    buffer[0] = '\0';
+
+  prom_set_t process = {"wiz", NULL, 0};
+  _emit_set(&w, &process);
+
+  if (count > 0) {
+    prom_set_t per_bulb = {"wiz_bulb", bulbs, count};
+    _emit_set(&w, &per_bulb);
+  }
+
+  return (int)w.total;
+}
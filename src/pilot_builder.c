@@ -2,6 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+extern int wiz_build_pilot_template(char *buffer, size_t size,
+                                    const wiz_pilot_builder_t *builder);
+extern unsigned int wiz_pilot_builder_fields(const wiz_pilot_builder_t *builder);
+
 wiz_pilot_builder_t *wiz_pilot_builder_create(void) {
   wiz_pilot_builder_t *builder =
       (wiz_pilot_builder_t *)calloc(1, sizeof(wiz_pilot_builder_t));
@@ -70,3 +74,138 @@ void wiz_pilot_builder_set_scene(wiz_pilot_builder_t *builder,
   builder->has_scene_id = true;
   builder->scene_id = scene_id;
 }
+
+// copy the builder's fields into a cached state once the bulb acked them
+void wiz_pilot_builder_commit(const wiz_pilot_builder_t *builder,
+                              wiz_bulb_state_t *state) {
+  if (!builder || !state)
+    return;
+
+  if (builder->has_state)
+    state->state = builder->state;
+  if (builder->has_brightness)
+    state->brightness = builder->brightness;
+  if (builder->has_rgb)
+    state->rgb = builder->rgb;
+  if (builder->has_temp)
+    state->temp = builder->temp;
+  if (builder->has_scene_id)
+    state->scene_id = builder->scene_id;
+  if (builder->has_speed)
+    state->speed = builder->speed;
+}
+
+// wiz_field_t mask of the fields a builder sets
+unsigned int wiz_pilot_builder_fields(const wiz_pilot_builder_t *builder) {
+  unsigned int fields = 0;
+
+  if (!builder)
+    return 0;
+
+  if (builder->has_state)
+    fields |= WIZ_FIELD_STATE;
+  if (builder->has_brightness)
+    fields |= WIZ_FIELD_BRIGHTNESS;
+  if (builder->has_rgb)
+    fields |= WIZ_FIELD_RGB;
+  if (builder->has_temp)
+    fields |= WIZ_FIELD_TEMP;
+  if (builder->has_scene_id)
+    fields |= WIZ_FIELD_SCENE;
+  if (builder->has_speed)
+    fields |= WIZ_FIELD_SPEED;
+  return fields;
+}
+
+// fold src into dst so the later write wins; color, temperature and scene
+// are exclusive modes on the bulb, so setting one drops the others
+void wiz_pilot_builder_merge(wiz_pilot_builder_t *dst,
+                             const wiz_pilot_builder_t *src) {
+  if (!dst || !src)
+    return;
+
+  if (src->has_state) {
+    dst->has_state = true;
+    dst->state = src->state;
+  }
+  if (src->has_brightness) {
+    dst->has_brightness = true;
+    dst->brightness = src->brightness;
+  }
+  if (src->has_rgb) {
+    dst->has_rgb = true;
+    dst->rgb = src->rgb;
+    dst->has_temp = false;
+    dst->has_scene_id = false;
+  }
+  if (src->has_temp) {
+    dst->has_temp = true;
+    dst->temp = src->temp;
+    dst->has_rgb = false;
+    dst->has_scene_id = false;
+  }
+  if (src->has_scene_id) {
+    dst->has_scene_id = true;
+    dst->scene_id = src->scene_id;
+    dst->has_rgb = false;
+    dst->has_temp = false;
+  }
+  if (src->has_speed) {
+    dst->has_speed = true;
+    dst->speed = src->speed;
+  }
+}
+
+// a setPilot request serialized once; every send copies the datagram and
+// stamps a fresh request id into its fixed-width id slot, so the message
+// itself is never written after compile
+struct wiz_pilot_message {
+  wiz_pilot_builder_t fields; // committed to each bulb's cache on ack
+  size_t length;
+  char data[];
+};
+
+// freeze a builder into its finished datagram; sending it again costs a copy
+// and a new id, no formatting
+wiz_pilot_message_t *wiz_pilot_builder_compile(const wiz_pilot_builder_t *builder) {
+  if (!builder)
+    return NULL;
+
+  char buffer[256];
+  int length = wiz_build_pilot_template(buffer, sizeof(buffer), builder);
+  if (length < 0)
+    return NULL;
+
+  wiz_pilot_message_t *message =
+      (wiz_pilot_message_t *)malloc(sizeof(*message) + (size_t)length + 1);
+  if (!message)
+    return NULL;
+
+  message->fields = *builder;
+  message->length = (size_t)length;
+  memcpy(message->data, buffer, (size_t)length + 1);
+  return message;
+}
+
+void wiz_pilot_message_destroy(wiz_pilot_message_t *message) {
+  free(message);
+}
+
+const char *wiz_pilot_message_data(const wiz_pilot_message_t *message,
+                                   size_t *length) {
+  if (!message)
+    return NULL;
+  if (length)
+    *length = message->length;
+  return message->data;
+}
+
+// wiz_field_t mask of what the message sets, as recorded at compile time
+unsigned int wiz_pilot_message_fields(const wiz_pilot_message_t *message) {
+  return message ? wiz_pilot_builder_fields(&message->fields) : 0;
+}
+
+const wiz_pilot_builder_t *
+wiz_pilot_message_builder(const wiz_pilot_message_t *message) {
+  return &message->fields;
+}
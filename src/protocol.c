@@ -1,13 +1,33 @@
 #include "../include/cwiz.h"
+#include "trace.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <sys/time.h>
 #include <unistd.h>
 
-
+extern uint64_t wiz_now_ms(void);
+int wiz_reply_matches(const char *request, const char *response);
+int wiz_bulb_reply_matches(wiz_bulb_t *bulb, const char *request,
+                           const char *response);
+extern void wiz_metrics_sent(wiz_bulb_t *bulb, size_t bytes, int attempt);
+extern void wiz_metrics_received(wiz_bulb_t *bulb, size_t bytes);
+extern void wiz_metrics_stale(wiz_bulb_t *bulb);
+extern void wiz_metrics_foreign(wiz_bulb_t *bulb);
+extern void wiz_metrics_rtt(wiz_bulb_t *bulb, uint32_t rtt_ms);
+extern void wiz_metrics_done(wiz_bulb_t *bulb, int result);
+#ifdef CWIZ_IO_URING
+extern int wiz_uring_exchange(int fd, const char *message, size_t message_len,
+                              const struct sockaddr_in *to, char *buffer,
+                              size_t size, struct sockaddr_in *from,
+                              unsigned int timeout_ms);
+#endif
+
+// ids let a reply be tied to the request that caused it
+static uint32_t next_request_id = 1;
 
 // internal helper to create socket
 int wiz_create_socket(void) {
@@ -29,52 +49,237 @@ int wiz_create_socket(void) {
   return sock;
 }
 
-// send a message and receive response
-int wiz_send_receive(int sock, struct sockaddr_in *addr, const char *message,
-                     char *response, size_t response_size) {
-  if (!message || !response || !addr) {
-    return WIZ_ERR_INVALID_PARAM;
+// wait before retransmitting, in milliseconds: 0.75s for the first attempt,
+// growing by 3s per attempt and capped at WIZ_DEFAULT_TIMEOUT
+unsigned int wiz_retry_wait_ms(int attempt) {
+  unsigned int wait_ms = 750 + 3000 * (unsigned int)attempt;
+  if (wait_ms > WIZ_DEFAULT_TIMEOUT * 1000) {
+    wait_ms = WIZ_DEFAULT_TIMEOUT * 1000;
   }
+  return wait_ms;
+}
 
-  int attempts = 0;
-  // wait_time in microseconds
-  unsigned int wait_time_us = 750000; // 0.75s
-
-  while (attempts < WIZ_MAX_RETRIES) {
-    // send datagram
-    ssize_t sent = sendto(sock, message, strlen(message), 0,
-                          (struct sockaddr *)addr, sizeof(*addr));
+static int _same_peer(const struct sockaddr_in *a,
+                      const struct sockaddr_in *b) {
+  return a->sin_addr.s_addr == b->sin_addr.s_addr &&
+         a->sin_port == b->sin_port;
+}
 
-    if (sent < 0) {
-      return WIZ_ERR_SOCKET;
+// internal helper to discard datagrams queued before a request was sent
+static void _drain_stale(wiz_bulb_t *bulb, char *buffer, size_t size) {
+  for (;;) {
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    ssize_t received = recvfrom(bulb->socket_fd, buffer, size, MSG_DONTWAIT,
+                                (struct sockaddr *)&from, &from_len);
+    if (received < 0)
+      return;
+    if (_same_peer(&from, &bulb->addr)) {
+      wiz_metrics_received(bulb, (size_t)received);
+      wiz_metrics_stale(bulb);
+    } else {
+      wiz_metrics_foreign(bulb);
     }
+  }
+}
 
-    // try to receive response
-    struct timeval tv;
-    tv.tv_sec = wait_time_us / 1000000;
-    tv.tv_usec = wait_time_us % 1000000;
+// feed one round trip into the estimator; callers only sample exchanges that
+// were never retransmitted (Karn's algorithm)
+void wiz_rtt_sample(wiz_rtt_t *rtt, uint32_t rtt_ms) {
+  if (!rtt)
+    return;
 
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (rtt->samples == 0) {
+    rtt->srtt = rtt_ms << 3;
+    rtt->rttvar = rtt_ms << 1;
+  } else {
+    // srtt += (sample - srtt) / 8, rttvar += (|sample - srtt| - rttvar) / 4
+    int32_t delta = (int32_t)rtt_ms - (int32_t)(rtt->srtt >> 3);
+    rtt->srtt = (uint32_t)((int32_t)rtt->srtt + delta);
+    if (delta < 0)
+      delta = -delta;
+    rtt->rttvar =
+        (uint32_t)((int32_t)rtt->rttvar + delta - (int32_t)(rtt->rttvar >> 2));
+  }
+  rtt->samples++;
+}
+
+// forget the estimate after a bulb stopped answering, so the next exchange
+// starts again from the conservative fixed schedule
+void wiz_rtt_reset(wiz_rtt_t *rtt) {
+  if (rtt)
+    memset(rtt, 0, sizeof(*rtt));
+}
+
+// wait for the given attempt: srtt + 4 * rttvar, clamped to
+// [WIZ_RTO_MIN_MS, WIZ_DEFAULT_TIMEOUT] and doubled per retransmission
+unsigned int wiz_rtt_timeout_ms(const wiz_rtt_t *rtt, int attempt) {
+  if (!rtt || rtt->samples == 0)
+    return wiz_retry_wait_ms(attempt);
+
+  unsigned int max_ms = WIZ_DEFAULT_TIMEOUT * 1000;
+  unsigned int rto_ms = (rtt->srtt >> 3) + rtt->rttvar;
+  if (rto_ms < WIZ_RTO_MIN_MS)
+    rto_ms = WIZ_RTO_MIN_MS;
+
+  for (int i = 0; i < attempt && rto_ms < max_ms; i++)
+    rto_ms <<= 1;
+
+  return rto_ms < max_ms ? rto_ms : max_ms;
+}
 
-    socklen_t addr_len = sizeof(*addr);
-    ssize_t received = recvfrom(sock, response, response_size - 1, 0,
-                                (struct sockaddr *)addr, &addr_len);
+// internal helper: send message (when non-NULL), then wait until deadline for
+// one datagram; returns its length, 0 on timeout or WIZ_ERR_SOCKET
+static ssize_t _exchange(int sock, const char *message, size_t message_len,
+                         const struct sockaddr_in *addr, char *buffer,
+                         size_t size, struct sockaddr_in *from,
+                         uint64_t deadline) {
+#ifdef CWIZ_IO_URING
+  // send, receive and timeout go out as one linked chain; an empty datagram
+  // before the deadline just means waiting again
+  for (;;) {
+    uint64_t now = wiz_now_ms();
+    unsigned int wait_ms = now < deadline ? (unsigned int)(deadline - now) : 0;
+    int ret = wiz_uring_exchange(sock, message, message_len, addr, buffer,
+                                 size, from, wait_ms);
+    if (ret == WIZ_ERR_CONNECTION)
+      break; // no ring on this thread: plain sockets below
+    if (ret != 0 || wait_ms == 0 || wiz_now_ms() >= deadline)
+      return ret;
+    message = NULL;
+  }
+#endif
+
+  if (message && sendto(sock, message, message_len, 0,
+                        (const struct sockaddr *)addr, sizeof(*addr)) < 0)
+    return WIZ_ERR_SOCKET;
+
+  for (;;) {
+    uint64_t now = wiz_now_ms();
+    if (now >= deadline)
+      return 0;
+
+    struct pollfd pfd = {sock, POLLIN, 0};
+    int ready = poll(&pfd, 1, (int)(deadline - now));
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready <= 0)
+      return 0;
+
+    socklen_t from_len = sizeof(*from);
+    ssize_t received = recvfrom(sock, buffer, size, MSG_DONTWAIT,
+                                (struct sockaddr *)from, &from_len);
+    if (received > 0)
+      return received;
+  }
+}
+
+// send a message and receive response; only a datagram from the bulb that
+// answers this request ends the wait, anything else is counted and dropped
+int wiz_send_receive(wiz_bulb_t *bulb, const char *message, char *response,
+                     size_t response_size) {
+  if (!bulb || !message || !response || response_size < 2) {
+    return WIZ_ERR_INVALID_PARAM;
+  }
+
+  int sock = bulb->socket_fd;
+  const struct sockaddr_in *addr = &bulb->addr;
+  size_t message_len = strlen(message);
+  int attempts = 0;
+  uint64_t first_sent = 0;
+
+  // anything already waiting is a late reply to an earlier exchange
+  _drain_stale(bulb, response, response_size);
+
+  while (attempts < WIZ_MAX_RETRIES) {
+    uint64_t sent_at = wiz_now_ms();
+    if (attempts == 0)
+      first_sent = sent_at;
+    uint64_t deadline = sent_at + wiz_rtt_timeout_ms(&bulb->rtt, attempts);
+
+    // send datagram, then keep waiting for a matching response until this
+    // attempt's deadline
+    const char *outgoing = message;
+    wiz_metrics_sent(bulb, message_len, attempts);
+    WIZ_TRACE(attempts ? WIZ_TRACE_RETRANSMIT : WIZ_TRACE_SEND, addr, message,
+              attempts, (int)message_len);
+    for (;;) {
+      struct sockaddr_in from;
+      ssize_t received = _exchange(sock, outgoing, message_len, addr, response,
+                                   response_size - 1, &from, deadline);
+      outgoing = NULL;
+      if (received < 0) {
+        wiz_metrics_done(bulb, WIZ_ERR_SOCKET);
+        return WIZ_ERR_SOCKET;
+      }
+      if (received == 0) {
+        WIZ_TRACE(WIZ_TRACE_TIMEOUT, addr, message, attempts, WIZ_ERR_TIMEOUT);
+        break;
+      }
+
+      if (!_same_peer(&from, addr)) {
+        wiz_metrics_foreign(bulb);
+        continue;
+      }
 
-    if (received > 0) {
+      wiz_metrics_received(bulb, (size_t)received);
       response[received] = '\0';
+      WIZ_TRACE(WIZ_TRACE_RECEIVE, addr, response, attempts, (int)received);
+      if (!wiz_bulb_reply_matches(bulb, message, response)) {
+        wiz_metrics_stale(bulb);
+        WIZ_TRACE(WIZ_TRACE_PARSE, addr, response, attempts,
+                  WIZ_ERR_JSON_PARSE);
+        continue;
+      }
+      WIZ_TRACE(WIZ_TRACE_PARSE, addr, response, attempts, WIZ_OK);
+
+      if (attempts == 0) {
+        uint32_t rtt_ms = (uint32_t)(wiz_now_ms() - first_sent);
+        wiz_rtt_sample(&bulb->rtt, rtt_ms);
+        wiz_metrics_rtt(bulb, rtt_ms);
+      }
+      wiz_metrics_done(bulb, WIZ_OK);
       return WIZ_OK;
     }
 
     attempts++;
-    wait_time_us += 3000000; // increase wait time by 3 seconds
-    if (wait_time_us > (unsigned int)(WIZ_DEFAULT_TIMEOUT * 1000000)) {
-      wait_time_us = (unsigned int)(WIZ_DEFAULT_TIMEOUT * 1000000);
-    }
   }
 
+  wiz_rtt_reset(&bulb->rtt);
+  wiz_metrics_done(bulb, WIZ_ERR_TIMEOUT);
   return WIZ_ERR_TIMEOUT;
 }
 
+// longest setPilot message wiz_build_pilot_message() can produce, rounded up
+#define PILOT_MESSAGE_MAX 192
+
+// append helpers for the hand-rolled writers below; callers check the
+// worst-case length up front so these never bounds-check
+#define PUT_LIT(p, lit) _put_bytes((p), (lit), sizeof(lit) - 1)
+
+static char *_put_bytes(char *p, const char *src, size_t len) {
+  memcpy(p, src, len);
+  return p + len;
+}
+
+static char *_put_uint(char *p, uint32_t value) {
+  char digits[10];
+  int n = 0;
+  do {
+    digits[n++] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value);
+  while (n)
+    *p++ = digits[--n];
+  return p;
+}
+
+static uint32_t _take_request_id(void) {
+  // kept below 2^31 so ids read back as non-negative ints
+  return __atomic_fetch_add(&next_request_id, 1, __ATOMIC_RELAXED) &
+         0x7fffffff;
+}
+
 // build JSON message
 int wiz_build_json_message(char *buffer, size_t size, const char *method,
                            const char *params) {
@@ -82,149 +287,634 @@ int wiz_build_json_message(char *buffer, size_t size, const char *method,
     return WIZ_ERR_INVALID_PARAM;
   }
 
-  int len;
-  if (params && strlen(params) > 0) {
-    len = snprintf(buffer, size, "{\"method\":\"%s\",\"params\":%s}", method,
-                   params);
-  } else {
-    len = snprintf(buffer, size, "{\"method\":\"%s\"}", method);
+  size_t method_len = strlen(method);
+  size_t params_len = params ? strlen(params) : 0;
+  // {"id":<10>,"method":"<m>","params":<p>}
+  if (size < 40 + method_len + params_len) {
+    return WIZ_ERR_INVALID_PARAM;
   }
 
-  if (len < 0 || (size_t)len >= size) {
-    return WIZ_ERR_INVALID_PARAM;
+  char *p = buffer;
+  p = PUT_LIT(p, "{\"id\":");
+  p = _put_uint(p, _take_request_id());
+  p = PUT_LIT(p, ",\"method\":\"");
+  p = _put_bytes(p, method, method_len);
+  *p++ = '"';
+  if (params_len > 0) {
+    p = PUT_LIT(p, ",\"params\":");
+    p = _put_bytes(p, params, params_len);
   }
+  *p++ = '}';
+  *p = '\0';
 
   return WIZ_OK;
 }
 
-// internal helper to verify if a match is a valid key
-static int _is_valid_key_start(const char *json, const char *match_ptr) {
-  // if match is at the very start (unlikely for valid JSON), assume valid
-  if (match_ptr == json) return 1;
+// a compiled pilot keeps its id in a fixed-width slot right after the opening
+// {"id": so that each send can stamp a fresh one in place
+#define PILOT_ID_OFFSET 6
+#define PILOT_ID_WIDTH 10
+
+// the id followed by spaces up to the slot's width; JSON allows whitespace
+// before the comma
+static char *_put_id_slot(char *p, uint32_t id) {
+  char *end = _put_uint(p, id);
+  memset(end, ' ', (size_t)(p + PILOT_ID_WIDTH - end));
+  return p + PILOT_ID_WIDTH;
+}
+
+// give a message built by wiz_build_pilot_template() a new request id;
+// returns the id
+uint32_t wiz_stamp_request_id(char *message) {
+  uint32_t id = _take_request_id();
+  _put_id_slot(message + PILOT_ID_OFFSET, id);
+  return id;
+}
+
+static int _build_pilot(char *buffer, size_t size,
+                        const wiz_pilot_builder_t *builder, bool id_slot,
+                        uint32_t *id) {
+  if (!buffer || !builder || size < PILOT_MESSAGE_MAX) {
+    return WIZ_ERR_INVALID_PARAM;
+  }
+
+  uint32_t request_id = _take_request_id();
+  if (id)
+    *id = request_id;
+
+  char *p = buffer;
+  p = PUT_LIT(p, "{\"id\":");
+  p = id_slot ? _put_id_slot(p, request_id) : _put_uint(p, request_id);
+  p = PUT_LIT(p, ",\"method\":\"setPilot\",\"params\":{");
+
+  char *fields = p;
+  if (builder->has_state)
+    p = builder->state ? PUT_LIT(p, "\"state\":true,")
+                       : PUT_LIT(p, "\"state\":false,");
+  if (builder->has_brightness) {
+    p = PUT_LIT(p, "\"dimming\":");
+    p = _put_uint(p, builder->brightness);
+    *p++ = ',';
+  }
+  if (builder->has_rgb) {
+    p = PUT_LIT(p, "\"r\":");
+    p = _put_uint(p, builder->rgb.r);
+    p = PUT_LIT(p, ",\"g\":");
+    p = _put_uint(p, builder->rgb.g);
+    p = PUT_LIT(p, ",\"b\":");
+    p = _put_uint(p, builder->rgb.b);
+    *p++ = ',';
+  }
+  if (builder->has_temp) {
+    p = PUT_LIT(p, "\"temp\":");
+    p = _put_uint(p, builder->temp);
+    *p++ = ',';
+  }
+  if (builder->has_scene_id) {
+    p = PUT_LIT(p, "\"sceneId\":");
+    p = _put_uint(p, builder->scene_id);
+    *p++ = ',';
+  }
+  if (builder->has_speed) {
+    p = PUT_LIT(p, "\"speed\":");
+    p = _put_uint(p, builder->speed);
+    *p++ = ',';
+  }
+
+  // overwrite the trailing comma, if any field was written
+  if (p > fields)
+    p--;
+  *p++ = '}';
+  *p++ = '}';
+  *p = '\0';
+
+  return (int)(p - buffer);
+}
+
+// serialize a whole setPilot request straight into the wire buffer in one
+// pass; returns the message length and, when id is given, the request id
+// it carries
+int wiz_build_pilot_message(char *buffer, size_t size,
+                            const wiz_pilot_builder_t *builder, uint32_t *id) {
+  return _build_pilot(buffer, size, builder, false, id);
+}
+
+// the same request with its id in a fixed-width slot, for messages that are
+// sent many times and restamped with wiz_stamp_request_id() before each send
+int wiz_build_pilot_template(char *buffer, size_t size,
+                             const wiz_pilot_builder_t *builder) {
+  return _build_pilot(buffer, size, builder, true, NULL);
+}
+
+// single-pass JSON reader: replies are scanned once from left to right and
+// each key is dispatched as it is met, instead of searching the text per key
+
+#define JSON_MAX_DEPTH 16
+
+typedef struct {
+  const char *p;
+} json_reader_t;
+
+// called for each member of an object; must consume the value
+typedef int (*json_member_fn)(json_reader_t *r, const char *key,
+                              size_t key_len, void *ctx);
+
+static int _json_skip_value(json_reader_t *r, int depth);
+
+static void _json_skip_ws(json_reader_t *r) {
+  while (*r->p == ' ' || *r->p == '\t' || *r->p == '\n' || *r->p == '\r')
+    r->p++;
+}
+
+static int _json_expect(json_reader_t *r, char c) {
+  _json_skip_ws(r);
+  if (*r->p != c)
+    return 0;
+  r->p++;
+  return 1;
+}
 
-  // scan backwards skipping whitespace
-  const char *prev = match_ptr - 1;
-  while (prev > json && (*prev == ' ' || *prev == '\t' || *prev == '\n' || *prev == '\r')) {
-    prev--;
+// string token; the raw contents are returned with escapes left in place
+static int _json_read_string(json_reader_t *r, const char **start,
+                             size_t *len) {
+  _json_skip_ws(r);
+  if (*r->p != '"')
+    return 0;
+
+  const char *s = ++r->p;
+  while (*r->p != '"') {
+    if ((unsigned char)*r->p < 0x20) // includes the terminator
+      return 0;
+    if (*r->p == '\\' && *++r->p == '\0')
+      return 0;
+    r->p++;
   }
 
-  // valid key = '{' (start of object) || ',' (next item)
-  return (*prev == '{' || *prev == ',');
+  *start = s;
+  *len = (size_t)(r->p - s);
+  r->p++;
+  return 1;
 }
 
-// helper to extract integer value from JSON
-static int _json_get_int(const char *json, const char *key) {
-  char search_key[64];
-  snprintf(search_key, sizeof(search_key), "\"%s\":", key);
-  size_t key_len = strlen(search_key);
+static int _is_digit(char c) { return c >= '0' && c <= '9'; }
+
+// number token; fractions and exponents are accepted and truncated
+static int _json_read_number(json_reader_t *r, long *value) {
+  _json_skip_ws(r);
+  const char *p = r->p;
+  int negative = (*p == '-');
+  if (negative)
+    p++;
+  if (!_is_digit(*p))
+    return 0;
+
+  long v = 0;
+  while (_is_digit(*p)) {
+    if (v < 100000000L) // saturate, no field needs more
+      v = v * 10 + (*p - '0');
+    p++;
+  }
+  if (*p == '.') {
+    if (!_is_digit(*++p))
+      return 0;
+    while (_is_digit(*p))
+      p++;
+  }
+  if (*p == 'e' || *p == 'E') {
+    p++;
+    if (*p == '+' || *p == '-')
+      p++;
+    if (!_is_digit(*p))
+      return 0;
+    while (_is_digit(*p))
+      p++;
+  }
 
-  const char *ptr = json;
-  
-  // loop through all occurrences of the key
-  while ((ptr = strstr(ptr, search_key)) != NULL) {
-    if (_is_valid_key_start(json, ptr)) {
-      // found the real key, advance to value
-      ptr += key_len;
-      // Skip whitespace
-      while (*ptr == ' ' || *ptr == '\t' || *ptr == '\n' || *ptr == '\r') {
-        ptr++;
+  *value = negative ? -v : v;
+  r->p = p;
+  return 1;
+}
+
+static int _json_read_literal(json_reader_t *r, const char *literal,
+                              size_t len) {
+  if (strncmp(r->p, literal, len) != 0)
+    return 0;
+  r->p += len;
+  return 1;
+}
+
+static int _json_read_object(json_reader_t *r, int depth, json_member_fn member,
+                             void *ctx) {
+  if (depth > JSON_MAX_DEPTH || !_json_expect(r, '{'))
+    return 0;
+
+  _json_skip_ws(r);
+  if (*r->p == '}') {
+    r->p++;
+    return 1;
+  }
+
+  for (;;) {
+    const char *key;
+    size_t key_len;
+    if (!_json_read_string(r, &key, &key_len) || !_json_expect(r, ':'))
+      return 0;
+
+    int ok = member ? member(r, key, key_len, ctx)
+                    : _json_skip_value(r, depth + 1);
+    if (!ok)
+      return 0;
+
+    _json_skip_ws(r);
+    if (*r->p == ',') {
+      r->p++;
+    } else if (*r->p == '}') {
+      r->p++;
+      return 1;
+    } else {
+      return 0;
+    }
+  }
+}
+
+static int _json_skip_value(json_reader_t *r, int depth) {
+  const char *s;
+  size_t len;
+  long number;
+
+  if (depth > JSON_MAX_DEPTH)
+    return 0;
+
+  _json_skip_ws(r);
+  switch (*r->p) {
+  case '{':
+    return _json_read_object(r, depth, NULL, NULL);
+  case '[':
+    r->p++;
+    _json_skip_ws(r);
+    if (*r->p == ']') {
+      r->p++;
+      return 1;
+    }
+    for (;;) {
+      if (!_json_skip_value(r, depth + 1))
+        return 0;
+      _json_skip_ws(r);
+      if (*r->p == ',') {
+        r->p++;
+      } else if (*r->p == ']') {
+        r->p++;
+        return 1;
+      } else {
+        return 0;
       }
-      return atoi(ptr);
     }
-    // false positive (key inside a string), skip and keep searching
-    ptr += 1; 
+  case '"':
+    return _json_read_string(r, &s, &len);
+  case 't':
+    return _json_read_literal(r, "true", 4);
+  case 'f':
+    return _json_read_literal(r, "false", 5);
+  case 'n':
+    return _json_read_literal(r, "null", 4);
+  default:
+    return _json_read_number(r, &number);
+  }
+}
+
+// typed member readers: a value of an unexpected type is skipped, not fatal,
+// so firmware quirks in one field do not discard the whole reply
+
+static int _member_int(json_reader_t *r, long *value, int *found) {
+  const char *start = r->p;
+  if (_json_read_number(r, value)) {
+    *found = 1;
+    return 1;
+  }
+  r->p = start;
+  *found = 0;
+  return _json_skip_value(r, 1);
+}
+
+static int _member_bool(json_reader_t *r, bool *value) {
+  _json_skip_ws(r);
+  if (_json_read_literal(r, "true", 4)) {
+    *value = true;
+    return 1;
   }
+  if (_json_read_literal(r, "false", 5)) {
+    *value = false;
+    return 1;
+  }
+  return _json_skip_value(r, 1);
+}
+
+// copy a string or number value as text, truncated to the buffer
+static int _member_text(json_reader_t *r, char *out, size_t size) {
+  const char *start;
+  size_t len;
 
-  return -1;
+  _json_skip_ws(r);
+  const char *token = r->p;
+  if (*token == '"') {
+    if (!_json_read_string(r, &start, &len))
+      return 0;
+  } else {
+    long number;
+    if (!_json_read_number(r, &number))
+      return _json_skip_value(r, 1);
+    start = token;
+    len = (size_t)(r->p - token);
+  }
+
+  if (len >= size)
+    len = size - 1;
+  memcpy(out, start, len);
+  out[len] = '\0';
+  return 1;
 }
 
-// helper to extract boolean value from JSON
-static int _json_get_bool(const char *json, const char *key) {
-  char search_key[64];
-  snprintf(search_key, sizeof(search_key), "\"%s\":", key);
-  size_t key_len = strlen(search_key);
+static uint8_t _clamp_u8(long v) {
+  return v < 0 ? 0 : v > 255 ? 255 : (uint8_t)v;
+}
 
-  const char *ptr = json;
+static uint16_t _clamp_u16(long v) {
+  return v < 0 ? 0 : v > 65535 ? 65535 : (uint16_t)v;
+}
 
-  while ((ptr = strstr(ptr, search_key)) != NULL) {
-    if (_is_valid_key_start(json, ptr)) {
-      ptr += key_len;
-      while (*ptr == ' ' || *ptr == '\t' || *ptr == '\n' || *ptr == '\r') {
-        ptr++;
+#define KEY_IS(key, key_len, literal)                                          \
+  ((key_len) == sizeof(literal) - 1 &&                                        \
+   memcmp((key), (literal), sizeof(literal) - 1) == 0)
+
+typedef struct {
+  // envelope
+  const char *method;
+  size_t method_len;
+  long id;
+  int has_id;
+  int has_result;
+  // result sinks, either may be NULL
+  wiz_bulb_state_t *state;
+  wiz_bulb_info_t *info;
+} json_reply_t;
+
+// members of "result" for getPilot, syncPilot and getSystemConfig
+static int _result_member(json_reader_t *r, const char *key, size_t key_len,
+                          void *ctx) {
+  json_reply_t *reply = (json_reply_t *)ctx;
+  wiz_bulb_state_t *state = reply->state;
+  wiz_bulb_info_t *info = reply->info;
+  long v;
+  int found = 0;
+
+  switch (key_len) {
+  case 1:
+    if (!state || !strchr("rgbcw", key[0]))
+      break;
+    if (!_member_int(r, &v, &found))
+      return 0;
+    if (found) {
+      uint8_t c = _clamp_u8(v);
+      switch (key[0]) {
+      case 'r':
+        state->rgb.r = state->rgbcw.r = c;
+        break;
+      case 'g':
+        state->rgb.g = state->rgbcw.g = c;
+        break;
+      case 'b':
+        state->rgb.b = state->rgbcw.b = c;
+        break;
+      case 'c':
+        state->rgbcw.c = c;
+        break;
+      default:
+        state->rgbcw.w = c;
+        break;
       }
-      return (*ptr == 't' || *ptr == 'T');
     }
-    ptr += 1;
+    return 1;
+  case 3:
+    if (info && KEY_IS(key, key_len, "mac"))
+      return _member_text(r, info->mac_address, sizeof(info->mac_address));
+    if (state && KEY_IS(key, key_len, "src"))
+      return _member_text(r, state->src, sizeof(state->src));
+    break;
+  case 4:
+    if (state && KEY_IS(key, key_len, "temp")) {
+      if (!_member_int(r, &v, &found))
+        return 0;
+      if (found)
+        state->temp = _clamp_u16(v);
+      return 1;
+    }
+    if (state && KEY_IS(key, key_len, "rssi")) {
+      if (!_member_int(r, &v, &found))
+        return 0;
+      if (found)
+        state->rssi = (int)v;
+      return 1;
+    }
+    break;
+  case 5:
+    if (state && KEY_IS(key, key_len, "state"))
+      return _member_bool(r, &state->state);
+    if (state && KEY_IS(key, key_len, "speed")) {
+      if (!_member_int(r, &v, &found))
+        return 0;
+      if (found)
+        state->speed = _clamp_u8(v);
+      return 1;
+    }
+    break;
+  case 6:
+    if (info && KEY_IS(key, key_len, "homeId"))
+      return _member_text(r, info->home_id, sizeof(info->home_id));
+    if (info && KEY_IS(key, key_len, "roomId"))
+      return _member_text(r, info->room_id, sizeof(info->room_id));
+    break;
+  case 7:
+    if (state && KEY_IS(key, key_len, "dimming")) {
+      if (!_member_int(r, &v, &found))
+        return 0;
+      if (found)
+        state->brightness = _clamp_u8(v);
+      return 1;
+    }
+    if (state && KEY_IS(key, key_len, "sceneId")) {
+      if (!_member_int(r, &v, &found))
+        return 0;
+      if (found)
+        state->scene_id = _clamp_u16(v);
+      return 1;
+    }
+    break;
+  case 9:
+    if (info && KEY_IS(key, key_len, "fwVersion"))
+      return _member_text(r, info->firmware_version,
+                          sizeof(info->firmware_version));
+    break;
+  case 10:
+    if (info && KEY_IS(key, key_len, "moduleName"))
+      return _member_text(r, info->module_name, sizeof(info->module_name));
+    break;
   }
 
-  return -1;
+  return _json_skip_value(r, 1);
 }
 
-// parse simple JSON response (basic parser for getPilot response)
-int wiz_parse_get_pilot_response(const char *json, wiz_bulb_state_t *state) {
-  if (!json || !state) {
-    return WIZ_ERR_INVALID_PARAM;
+// top-level members: method, id and the result object
+static int _envelope_member(json_reader_t *r, const char *key, size_t key_len,
+                            void *ctx) {
+  json_reply_t *reply = (json_reply_t *)ctx;
+
+  if (KEY_IS(key, key_len, "method")) {
+    _json_skip_ws(r);
+    if (*r->p == '"')
+      return _json_read_string(r, &reply->method, &reply->method_len);
+  } else if (KEY_IS(key, key_len, "id")) {
+    int found = 0;
+    if (!_member_int(r, &reply->id, &found))
+      return 0;
+    reply->has_id = found;
+    return 1;
+  } else if (KEY_IS(key, key_len, "result") ||
+             KEY_IS(key, key_len, "params")) {
+    // syncPilot pushes carry the state in params rather than result
+    _json_skip_ws(r);
+    if (*r->p == '{') {
+      reply->has_result = 1;
+      if (reply->state || reply->info)
+        return _json_read_object(r, 1, _result_member, reply);
+    }
   }
 
-  int val = _json_get_bool(json, "state");
-  if (val != -1) state->state = val;
+  return _json_skip_value(r, 1);
+}
 
-  val = _json_get_int(json, "dimming");
-  if (val != -1) state->brightness = val;
+// scan a whole message once; only whitespace may follow the outer object
+static int _parse_reply(const char *json, json_reply_t *reply) {
+  json_reader_t r = {json};
+  if (!_json_read_object(&r, 0, _envelope_member, reply))
+    return WIZ_ERR_JSON_PARSE;
 
-  val = _json_get_int(json, "temp");
-  if (val != -1) state->temp = val;
+  _json_skip_ws(&r);
+  return *r.p == '\0' ? WIZ_OK : WIZ_ERR_JSON_PARSE;
+}
+
+// method and request id of a reply in one pass; id is -1 when the reply
+// carries none. The method points into json and is not terminated.
+int wiz_reply_envelope(const char *json, const char **method,
+                       size_t *method_len, long *id) {
+  if (!json || !method || !method_len || !id)
+    return WIZ_ERR_INVALID_PARAM;
 
-  val = _json_get_int(json, "sceneId");
-  if (val != -1) state->scene_id = val;
+  json_reply_t reply = {0};
+  if (_parse_reply(json, &reply) != WIZ_OK || !reply.method)
+    return WIZ_ERR_JSON_PARSE;
 
-  val = _json_get_int(json, "r");
-  if (val != -1) state->rgb.r = val;
+  *method = reply.method;
+  *method_len = reply.method_len;
+  *id = reply.has_id && reply.id >= 0 ? reply.id : -1;
+  return WIZ_OK;
+}
 
-  val = _json_get_int(json, "g");
-  if (val != -1) state->rgb.g = val;
+// method and id agree wherever both sides carry them
+static int _reply_match(const char *request, const char *response,
+                        json_reply_t *sent, json_reply_t *reply) {
+  if (!request || !response)
+    return 0;
 
-  val = _json_get_int(json, "b");
-  if (val != -1) state->rgb.b = val;
+  if (_parse_reply(request, sent) != WIZ_OK ||
+      _parse_reply(response, reply) != WIZ_OK)
+    return 0;
 
-  val = _json_get_int(json, "rssi");
-  if (val != -1) state->rssi = val;
+  if (!sent->method || !reply->method ||
+      sent->method_len != reply->method_len ||
+      memcmp(sent->method, reply->method, sent->method_len) != 0)
+    return 0;
 
+  if (sent->has_id && reply->has_id && sent->id != reply->id)
+    return 0;
+
+  return 1;
+}
+
+// check that a response answers the request: the method must be echoed and,
+// when the bulb echoes our id, the id must match too
+int wiz_reply_matches(const char *request, const char *response) {
+  json_reply_t sent = {0};
+  json_reply_t reply = {0};
+  return _reply_match(request, response, &sent, &reply);
+}
+
+// the same check for a reply from a known bulb: once the bulb has echoed an
+// id, a reply without one (a late duplicate, say) no longer answers a request
+// that carries an id
+int wiz_bulb_reply_matches(wiz_bulb_t *bulb, const char *request,
+                           const char *response) {
+  json_reply_t sent = {0};
+  json_reply_t reply = {0};
+  if (!bulb || !_reply_match(request, response, &sent, &reply))
+    return 0;
+
+  if (sent.has_id && !reply.has_id)
+    return !bulb->echoes_id;
+  if (reply.has_id)
+    bulb->echoes_id = true;
+  return 1;
+}
+
+// parse a getPilot (or syncPilot) reply into state and, when given, the
+// identity fields it carries; nothing is written unless the reply is valid
+int wiz_parse_pilot_reply(const char *json, wiz_bulb_state_t *state,
+                          wiz_bulb_info_t *info) {
+  if (!json || !state) {
+    return WIZ_ERR_INVALID_PARAM;
+  }
+
+  wiz_bulb_state_t new_state = *state;
+  wiz_bulb_info_t new_info;
+  if (info)
+    new_info = *info;
+
+  json_reply_t reply = {0};
+  reply.state = &new_state;
+  reply.info = info ? &new_info : NULL;
+
+  int ret = _parse_reply(json, &reply);
+  if (ret != WIZ_OK)
+    return ret;
+  if (!reply.has_result)
+    return WIZ_ERR_JSON_PARSE;
+
+  *state = new_state;
+  if (info)
+    *info = new_info;
   return WIZ_OK;
 }
 
+// parse simple JSON response (basic parser for getPilot response)
+int wiz_parse_get_pilot_response(const char *json, wiz_bulb_state_t *state) {
+  return wiz_parse_pilot_reply(json, state, NULL);
+}
+
 // parse system config response
 int wiz_parse_system_config(const char *json, wiz_bulb_info_t *info) {
   if (!json || !info) {
     return WIZ_ERR_INVALID_PARAM;
   }
 
-  // parse MAC address
-  const char *ptr = strstr(json, "\"mac\":");
-  if (ptr) {
-    ptr += 7; // skip "mac":" "
-    while (*ptr == ' ' || *ptr == '\"')
-      ptr++;
-    sscanf(ptr, "%17[^\"]", info->mac_address);
-  }
-
-  // parse module name
-  ptr = strstr(json, "\"moduleName\":");
-  if (ptr) {
-    ptr += 14;
-    while (*ptr == ' ' || *ptr == '\"')
-      ptr++;
-    sscanf(ptr, "%63[^\"]", info->module_name);
-  }
+  wiz_bulb_info_t new_info = *info;
+  json_reply_t reply = {0};
+  reply.info = &new_info;
 
-  // parse firmware version
-  ptr = strstr(json, "\"fwVersion\":");
-  if (ptr) {
-    ptr += 13;
-    while (*ptr == ' ' || *ptr == '\"')
-      ptr++;
-    sscanf(ptr, "%31[^\"]", info->firmware_version);
-  }
+  int ret = _parse_reply(json, &reply);
+  if (ret != WIZ_OK)
+    return ret;
+  if (!reply.has_result)
+    return WIZ_ERR_JSON_PARSE;
 
+  *info = new_info;
   return WIZ_OK;
 }
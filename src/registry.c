@@ -0,0 +1,507 @@
+#include "../include/cwiz.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// entries live in fixed-size blocks that are never moved or freed before the
+// registry, so pointers to them stay valid
+#define REGISTRY_CHUNK 64
+
+// snapshot file: a header followed by count fixed-size records, in host byte
+// order so the file can be mapped and read in place
+#define SNAPSHOT_MAGIC "CWIZREG"
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size; // stride between records, >= sizeof(snapshot_record_t)
+  uint32_t count;
+  uint32_t checksum; // over the fields above
+} snapshot_header_t;
+
+typedef struct {
+  char mac_address[18];
+  char ip_address[16];
+  char module_name[64];
+  char firmware_version[32];
+  uint8_t reserved[6];
+  int64_t last_seen;
+  uint32_t checksum; // over the fields above
+  uint32_t reserved2;
+} snapshot_record_t;
+
+_Static_assert(sizeof(snapshot_header_t) == 24, "snapshot header layout");
+_Static_assert(sizeof(snapshot_record_t) == 152, "snapshot record layout");
+
+// keys that are not a plain MAC or IPv4 address are hashed and tagged with
+// the top bit so they can never collide with a real one
+#define REGISTRY_KEY_HASHED (1ULL << 63)
+
+static uint64_t _hash_string(const char *s) {
+  // FNV-1a
+  uint64_t h = 0xcbf29ce484222325ULL;
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 0x100000001b3ULL;
+  }
+  return h | REGISTRY_KEY_HASHED;
+}
+
+static int _hex_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// normalized MAC: 12 hex digits in any case, ':' or '-' separators ignored
+static uint64_t _mac_key(const char *mac) {
+  uint64_t key = 0;
+  int digits = 0;
+
+  for (const char *p = mac; *p; p++) {
+    if (*p == ':' || *p == '-')
+      continue;
+    int v = _hex_value(*p);
+    if (v < 0 || ++digits > 12)
+      return _hash_string(mac);
+    key = (key << 4) | (uint64_t)v;
+  }
+
+  return digits == 12 ? key : _hash_string(mac);
+}
+
+static uint64_t _ip_key(const char *ip) {
+  struct in_addr addr;
+  if (inet_pton(AF_INET, ip, &addr) == 1)
+    return ntohl(addr.s_addr);
+  return _hash_string(ip);
+}
+
+static uint32_t _hash_key(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return (uint32_t)key;
+}
+
+// indexes (open addressing, linear probing)
+
+// table from a normalized key to an entry position
+typedef struct {
+  uint64_t *keys;
+  int *slots; // entry position, -1 when empty
+  uint32_t mask;
+  int count;
+} registry_table_t;
+
+// the part of a registry callers never see
+struct wiz_registry_index {
+  wiz_discovered_bulb_t **chunks; // REGISTRY_CHUNK entries each
+  int chunk_count;
+  wiz_discovered_bulb_t *tail; // last entry of the bulbs/next list
+  registry_table_t by_mac;
+  registry_table_t by_ip;
+};
+
+static int _index_init(registry_table_t *index, uint32_t size) {
+  index->keys = (uint64_t *)malloc(size * sizeof(uint64_t));
+  index->slots = (int *)malloc(size * sizeof(int));
+  if (!index->keys || !index->slots) {
+    free(index->keys);
+    free(index->slots);
+    index->keys = NULL;
+    index->slots = NULL;
+    return WIZ_ERR_MALLOC;
+  }
+  for (uint32_t i = 0; i < size; i++)
+    index->slots[i] = -1;
+  index->mask = size - 1;
+  index->count = 0;
+  return WIZ_OK;
+}
+
+static int _index_find(const registry_table_t *index, uint64_t key) {
+  if (!index->slots)
+    return -1;
+
+  uint32_t i = _hash_key(key) & index->mask;
+  while (index->slots[i] >= 0) {
+    if (index->keys[i] == key)
+      return (int)i;
+    i = (i + 1) & index->mask;
+  }
+  return -1;
+}
+
+static void _index_place(registry_table_t *index, uint64_t key, int slot) {
+  uint32_t i = _hash_key(key) & index->mask;
+  while (index->slots[i] >= 0)
+    i = (i + 1) & index->mask;
+  index->keys[i] = key;
+  index->slots[i] = slot;
+  index->count++;
+}
+
+static int _index_grow(registry_table_t *index) {
+  registry_table_t old = *index;
+  uint32_t new_size = old.slots ? (old.mask + 1) * 2 : 32;
+
+  if (_index_init(index, new_size) != WIZ_OK) {
+    *index = old;
+    return WIZ_ERR_MALLOC;
+  }
+
+  if (old.slots) {
+    for (uint32_t i = 0; i <= old.mask; i++) {
+      if (old.slots[i] >= 0)
+        _index_place(index, old.keys[i], old.slots[i]);
+    }
+  }
+
+  free(old.keys);
+  free(old.slots);
+  return WIZ_OK;
+}
+
+// map key to slot, replacing any previous mapping for the key
+static int _index_put(registry_table_t *index, uint64_t key, int slot) {
+  int pos = _index_find(index, key);
+  if (pos >= 0) {
+    index->slots[pos] = slot;
+    return WIZ_OK;
+  }
+
+  if (!index->slots || (uint32_t)(index->count + 1) * 2 > index->mask + 1) {
+    if (_index_grow(index) != WIZ_OK)
+      return WIZ_ERR_MALLOC;
+  }
+
+  _index_place(index, key, slot);
+  return WIZ_OK;
+}
+
+static void _index_remove(registry_table_t *index, int pos) {
+  // backward-shift deletion keeps probe chains intact without tombstones
+  uint32_t i = (uint32_t)pos;
+  uint32_t j = i;
+  for (;;) {
+    j = (j + 1) & index->mask;
+    if (index->slots[j] < 0)
+      break;
+    uint32_t home = _hash_key(index->keys[j]) & index->mask;
+    // move j into the hole at i unless its home lies cyclically in (i, j]
+    if ((j > i && (home <= i || home > j)) ||
+        (j < i && (home <= i && home > j))) {
+      index->keys[i] = index->keys[j];
+      index->slots[i] = index->slots[j];
+      i = j;
+    }
+  }
+  index->slots[i] = -1;
+  index->count--;
+}
+
+// entry storage
+
+static wiz_discovered_bulb_t *_entry(const wiz_bulb_registry_t *registry,
+                                     int slot) {
+  return &registry->index
+              ->chunks[slot / REGISTRY_CHUNK][slot % REGISTRY_CHUNK];
+}
+
+// make room for one more entry without moving the existing ones
+static int _reserve(wiz_bulb_registry_t *registry) {
+  struct wiz_registry_index *index = registry->index;
+  if (registry->count < index->chunk_count * REGISTRY_CHUNK)
+    return WIZ_OK;
+
+  wiz_discovered_bulb_t **chunks = (wiz_discovered_bulb_t **)realloc(
+      index->chunks, (size_t)(index->chunk_count + 1) * sizeof(*chunks));
+  if (!chunks)
+    return WIZ_ERR_MALLOC;
+  index->chunks = chunks;
+
+  chunks[index->chunk_count] = (wiz_discovered_bulb_t *)malloc(
+      REGISTRY_CHUNK * sizeof(wiz_discovered_bulb_t));
+  if (!chunks[index->chunk_count])
+    return WIZ_ERR_MALLOC;
+  index->chunk_count++;
+  return WIZ_OK;
+}
+
+// point the IP index at an entry, dropping the mapping for its old address
+static void _set_ip(wiz_bulb_registry_t *registry, int slot, const char *ip) {
+  wiz_discovered_bulb_t *bulb = _entry(registry, slot);
+
+  registry_table_t *by_ip = &registry->index->by_ip;
+  if (bulb->ip_address[0]) {
+    int pos = _index_find(by_ip, _ip_key(bulb->ip_address));
+    if (pos >= 0 && by_ip->slots[pos] == slot)
+      _index_remove(by_ip, pos);
+  }
+
+  snprintf(bulb->ip_address, sizeof(bulb->ip_address), "%s", ip);
+  // best effort: a failed insert only costs the IP lookup for this bulb
+  _index_put(by_ip, _ip_key(ip), slot);
+}
+
+wiz_bulb_registry_t *wiz_bulb_registry_create(void) {
+  wiz_bulb_registry_t *registry =
+      (wiz_bulb_registry_t *)calloc(1, sizeof(wiz_bulb_registry_t));
+  if (!registry)
+    return NULL;
+
+  registry->index =
+      (struct wiz_registry_index *)calloc(1, sizeof(struct wiz_registry_index));
+  if (!registry->index) {
+    free(registry);
+    return NULL;
+  }
+  return registry;
+}
+
+void wiz_bulb_registry_destroy(wiz_bulb_registry_t *registry) {
+  if (!registry)
+    return;
+
+  for (int i = 0; i < registry->index->chunk_count; i++)
+    free(registry->index->chunks[i]);
+  free(registry->index->chunks);
+  free(registry->index->by_mac.keys);
+  free(registry->index->by_mac.slots);
+  free(registry->index->by_ip.keys);
+  free(registry->index->by_ip.slots);
+  free(registry->index);
+  free(registry);
+}
+
+// add a bulb or refresh the address of a known one; returns its entry, which
+// keeps its address for the life of the registry, or NULL when out of memory
+wiz_discovered_bulb_t *wiz_registry_add(wiz_bulb_registry_t *registry,
+                                        const char *ip, const char *mac,
+                                        int *is_new) {
+  registry_table_t *by_mac = &registry->index->by_mac;
+  uint64_t key = _mac_key(mac);
+  int pos = _index_find(by_mac, key);
+
+  if (pos >= 0) {
+    int slot = by_mac->slots[pos];
+    // already registered, follow a DHCP address change
+    wiz_discovered_bulb_t *bulb = _entry(registry, slot);
+    if (strcmp(bulb->ip_address, ip) != 0)
+      _set_ip(registry, slot, ip);
+    if (is_new)
+      *is_new = 0;
+    return bulb;
+  }
+
+  if (_reserve(registry) != WIZ_OK)
+    return NULL;
+
+  int slot = registry->count;
+  if (_index_put(by_mac, key, slot) != WIZ_OK)
+    return NULL;
+
+  wiz_discovered_bulb_t *bulb = _entry(registry, slot);
+  memset(bulb, 0, sizeof(*bulb));
+  snprintf(bulb->mac_address, sizeof(bulb->mac_address), "%s", mac);
+
+  // append to the list
+  if (registry->index->tail)
+    registry->index->tail->next = bulb;
+  else
+    registry->bulbs = bulb;
+  registry->index->tail = bulb;
+  registry->count++;
+
+  _set_ip(registry, slot, ip);
+
+  if (is_new)
+    *is_new = 1;
+  return bulb;
+}
+
+wiz_discovered_bulb_t *wiz_registry_get_by_mac(wiz_bulb_registry_t *registry,
+                                               const char *mac_address) {
+  if (!registry || !mac_address) {
+    return NULL;
+  }
+
+  const registry_table_t *by_mac = &registry->index->by_mac;
+  int pos = _index_find(by_mac, _mac_key(mac_address));
+  return pos >= 0 ? _entry(registry, by_mac->slots[pos]) : NULL;
+}
+
+wiz_discovered_bulb_t *wiz_registry_get_by_ip(wiz_bulb_registry_t *registry,
+                                              const char *ip_address) {
+  if (!registry || !ip_address) {
+    return NULL;
+  }
+
+  const registry_table_t *by_ip = &registry->index->by_ip;
+  int pos = _index_find(by_ip, _ip_key(ip_address));
+  return pos >= 0 ? _entry(registry, by_ip->slots[pos]) : NULL;
+}
+
+// snapshots
+
+static uint32_t _checksum(const void *data, size_t size) {
+  // FNV-1a
+  const unsigned char *p = (const unsigned char *)data;
+  uint32_t h = 0x811c9dc5u;
+  for (size_t i = 0; i < size; i++) {
+    h ^= p[i];
+    h *= 0x01000193u;
+  }
+  return h;
+}
+
+static int _field_terminated(const char *field, size_t size) {
+  return memchr(field, '\0', size) != NULL;
+}
+
+// save to a temporary file and rename it over path, so readers never see a
+// half-written snapshot
+int wiz_registry_save(const wiz_bulb_registry_t *registry, const char *path) {
+  if (!registry || !path) {
+    return WIZ_ERR_INVALID_PARAM;
+  }
+
+  char tmp_path[4096];
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+      (int)sizeof(tmp_path))
+    return WIZ_ERR_INVALID_PARAM;
+
+  FILE *file = fopen(tmp_path, "wb");
+  if (!file)
+    return WIZ_ERR_IO;
+
+  snapshot_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  header.version = SNAPSHOT_VERSION;
+  header.record_size = sizeof(snapshot_record_t);
+  header.count = (uint32_t)registry->count;
+  header.checksum =
+      _checksum(&header, offsetof(snapshot_header_t, checksum));
+
+  int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+  for (const wiz_discovered_bulb_t *bulb = registry->bulbs; ok && bulb;
+       bulb = bulb->next) {
+    snapshot_record_t record;
+    memset(&record, 0, sizeof(record));
+    memcpy(record.mac_address, bulb->mac_address, sizeof(record.mac_address));
+    memcpy(record.ip_address, bulb->ip_address, sizeof(record.ip_address));
+    memcpy(record.module_name, bulb->module_name, sizeof(record.module_name));
+    memcpy(record.firmware_version, bulb->firmware_version,
+           sizeof(record.firmware_version));
+    record.last_seen = bulb->last_seen;
+    record.checksum =
+        _checksum(&record, offsetof(snapshot_record_t, checksum));
+    ok = fwrite(&record, sizeof(record), 1, file) == 1;
+  }
+
+  if (fclose(file) != 0)
+    ok = 0;
+  if (!ok || rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+    return WIZ_ERR_IO;
+  }
+
+  return WIZ_OK;
+}
+
+// merge a snapshot into the registry; records that fail validation are
+// skipped, and bulbs already known with a newer sighting are left alone.
+// returns the number of records taken from the file
+int wiz_registry_load(wiz_bulb_registry_t *registry, const char *path) {
+  if (!registry || !path) {
+    return WIZ_ERR_INVALID_PARAM;
+  }
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return WIZ_ERR_IO;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return WIZ_ERR_IO;
+  }
+  if ((size_t)st.st_size < sizeof(snapshot_header_t)) {
+    close(fd);
+    return WIZ_ERR_FORMAT;
+  }
+
+  size_t size = (size_t)st.st_size;
+  void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return WIZ_ERR_IO;
+
+  const snapshot_header_t *header = (const snapshot_header_t *)map;
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+      header->checksum !=
+          _checksum(header, offsetof(snapshot_header_t, checksum)) ||
+      header->version != SNAPSHOT_VERSION ||
+      header->record_size < sizeof(snapshot_record_t)) {
+    munmap(map, size);
+    return WIZ_ERR_FORMAT;
+  }
+
+  // a truncated file still yields the records that are complete
+  size_t available = (size - sizeof(*header)) / header->record_size;
+  size_t count = header->count < available ? header->count : available;
+  const char *base = (const char *)map + sizeof(*header);
+  int loaded = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    // copied out since a foreign record_size may leave records misaligned
+    snapshot_record_t copy;
+    memcpy(&copy, base + i * header->record_size, sizeof(copy));
+    const snapshot_record_t *record = &copy;
+
+    if (record->checksum !=
+            _checksum(record, offsetof(snapshot_record_t, checksum)) ||
+        !_field_terminated(record->mac_address, sizeof(record->mac_address)) ||
+        !_field_terminated(record->ip_address, sizeof(record->ip_address)) ||
+        !_field_terminated(record->module_name, sizeof(record->module_name)) ||
+        !_field_terminated(record->firmware_version,
+                           sizeof(record->firmware_version)) ||
+        record->mac_address[0] == '\0')
+      continue;
+
+    wiz_discovered_bulb_t *known =
+        wiz_registry_get_by_mac(registry, record->mac_address);
+    if (known && known->last_seen >= record->last_seen)
+      continue;
+
+    wiz_discovered_bulb_t *bulb = wiz_registry_add(
+        registry, record->ip_address, record->mac_address, NULL);
+    if (!bulb) {
+      munmap(map, size);
+      return WIZ_ERR_MALLOC;
+    }
+
+    memcpy(bulb->module_name, record->module_name, sizeof(bulb->module_name));
+    memcpy(bulb->firmware_version, record->firmware_version,
+           sizeof(bulb->firmware_version));
+    bulb->last_seen = record->last_seen;
+    loaded++;
+  }
+
+  munmap(map, size);
+  return loaded;
+}
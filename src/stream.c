@@ -0,0 +1,131 @@
+#include "../include/cwiz.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+extern int wiz_build_pilot_message(char *buffer, size_t size,
+                                   const wiz_pilot_builder_t *builder,
+                                   uint32_t *id);
+extern void wiz_pilot_builder_commit(const wiz_pilot_builder_t *builder,
+                                     wiz_bulb_state_t *state);
+extern int wiz_reply_envelope(const char *json, const char **method,
+                              size_t *method_len, long *id);
+extern unsigned int wiz_rtt_timeout_ms(const wiz_rtt_t *rtt, int attempt);
+extern void wiz_rtt_sample(wiz_rtt_t *rtt, uint32_t rtt_ms);
+extern void wiz_metrics_received(wiz_bulb_t *bulb, size_t bytes);
+extern void wiz_metrics_stale(wiz_bulb_t *bulb);
+extern void wiz_metrics_foreign(wiz_bulb_t *bulb);
+extern void wiz_metrics_rtt(wiz_bulb_t *bulb, uint32_t rtt_ms);
+extern uint64_t wiz_now_ms(void);
+
+// collect whatever acks have arrived without waiting; they only feed
+// liveness and the RTT estimate, nothing is ever retransmitted
+int wiz_bulb_stream_poll(wiz_bulb_t *bulb) {
+  if (!bulb)
+    return WIZ_ERR_INVALID_PARAM;
+
+  // on a shared socket the acks belong to the fleet's receive path, which
+  // drops them as answers to nothing; such a stream is never sampled
+  if (bulb->fleet)
+    return 0;
+
+  char response[1024];
+  int acks = 0;
+
+  for (;;) {
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    ssize_t received = recvfrom(bulb->socket_fd, response, sizeof(response) - 1,
+                                MSG_DONTWAIT, (struct sockaddr *)&from,
+                                &from_len);
+    if (received < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    if (from.sin_addr.s_addr != bulb->addr.sin_addr.s_addr ||
+        from.sin_port != bulb->addr.sin_port) {
+      wiz_metrics_foreign(bulb);
+      continue;
+    }
+    wiz_metrics_received(bulb, (size_t)received);
+    response[received] = '\0';
+
+    const char *method;
+    size_t method_len;
+    long id;
+    if (wiz_reply_envelope(response, &method, &method_len, &id) != WIZ_OK ||
+        method_len != sizeof("setPilot") - 1 ||
+        memcmp(method, "setPilot", method_len) != 0) {
+      wiz_metrics_stale(bulb);
+      continue;
+    }
+
+    uint64_t now = wiz_now_ms();
+    bulb->stream.acks++;
+    bulb->stream.last_ack_ms = now;
+    acks++;
+
+    // ids grow with every frame, so an ack for a newer frame means the
+    // timed one was lost and the next frame can be timed instead
+    if (id >= 0 && id == bulb->stream.sample_id) {
+      uint32_t rtt_ms = (uint32_t)(now - bulb->stream.sample_sent_ms);
+      wiz_rtt_sample(&bulb->rtt, rtt_ms);
+      wiz_metrics_rtt(bulb, rtt_ms);
+      bulb->stream.sample_id = -1;
+    } else if (id > bulb->stream.sample_id) {
+      bulb->stream.sample_id = -1;
+    }
+  }
+
+  return acks;
+}
+
+// send one frame without waiting for the ack; the cached state reflects the
+// last frame sent
+int wiz_bulb_stream_pilot(wiz_bulb_t *bulb,
+                          const wiz_pilot_builder_t *builder) {
+  if (!bulb || !builder)
+    return WIZ_ERR_INVALID_PARAM;
+
+  char message[256];
+  uint32_t id;
+
+  int length = wiz_build_pilot_message(message, sizeof(message), builder, &id);
+  if (length < 0)
+    return length;
+
+  wiz_bulb_stream_poll(bulb);
+
+  ssize_t sent = sendto(bulb->socket_fd, message, (size_t)length, MSG_DONTWAIT,
+                        (struct sockaddr *)&bulb->addr, sizeof(bulb->addr));
+  if (sent < 0) {
+    // a full socket buffer just drops this frame, the next one supersedes it
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      bulb->stream.dropped++;
+      return WIZ_OK;
+    }
+    return WIZ_ERR_SOCKET;
+  }
+
+  uint64_t now = wiz_now_ms();
+  bulb->stream.frames++;
+
+  // time one frame at a time; give up on a sample once its ack is overdue
+  if (bulb->stream.sample_id < 0 ||
+      now - bulb->stream.sample_sent_ms > wiz_rtt_timeout_ms(&bulb->rtt, 0)) {
+    bulb->stream.sample_id = (int)id;
+    bulb->stream.sample_sent_ms = now;
+  }
+
+  wiz_pilot_builder_commit(builder, &bulb->state);
+  return WIZ_OK;
+}
+
+int wiz_bulb_stream_rgb(wiz_bulb_t *bulb, uint8_t r, uint8_t g, uint8_t b) {
+  wiz_pilot_builder_t builder = {0};
+  wiz_pilot_builder_set_rgb(&builder, r, g, b);
+  return wiz_bulb_stream_pilot(bulb, &builder);
+}
@@ -0,0 +1,307 @@
+#include "../include/cwiz.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// threaded mode: producers on any thread push commands into a lock-free
+// multi-producer queue; one I/O thread owns the fleet and its sockets, runs
+// every callback and publishes each bulb's state through a seqlock
+
+typedef enum { IO_APPLY_PILOT, IO_UPDATE_STATE, IO_STOP } io_kind_t;
+
+typedef struct io_command {
+  struct io_command *_Atomic next;
+  io_kind_t kind;
+  wiz_bulb_t *bulb;
+  wiz_pilot_builder_t builder;
+  wiz_callback_t callback;
+  void *user_data;
+} io_command_t;
+
+// seqlock: seq is odd while the I/O thread is writing state
+struct wiz_snapshot {
+  atomic_uint seq;
+  wiz_bulb_state_t state;
+};
+
+struct wiz_io {
+  wiz_fleet_t *fleet;
+  pthread_t thread;
+  int wake_fd; // eventfd, written when the queue goes from idle to busy
+
+  // intrusive MPSC queue (Vyukov): producers swap themselves into head,
+  // the I/O thread consumes from tail; stub keeps it never empty
+  io_command_t *_Atomic head;
+  io_command_t *tail;
+  io_command_t stub;
+
+  atomic_int wake_pending; // a wakeup is already on its way
+};
+
+static void _queue_push(wiz_io_t *io, io_command_t *cmd) {
+  atomic_store_explicit(&cmd->next, NULL, memory_order_relaxed);
+  io_command_t *prev =
+      atomic_exchange_explicit(&io->head, cmd, memory_order_acq_rel);
+  atomic_store_explicit(&prev->next, cmd, memory_order_release);
+}
+
+// I/O thread only; NULL when empty or when a producer is between its two
+// steps, in which case its wakeup is still to come
+static io_command_t *_queue_pop(wiz_io_t *io) {
+  io_command_t *tail = io->tail;
+  io_command_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+  if (tail == &io->stub) {
+    if (!next)
+      return NULL;
+    io->tail = next;
+    tail = next;
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  }
+
+  if (next) {
+    io->tail = next;
+    return tail;
+  }
+
+  if (tail != atomic_load_explicit(&io->head, memory_order_acquire))
+    return NULL;
+
+  // tail is the last node: put the stub behind it so it can be handed out
+  _queue_push(io, &io->stub);
+  next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (next) {
+    io->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+static int _enqueue(wiz_io_t *io, io_command_t *cmd) {
+  _queue_push(io, cmd);
+
+  // only the first producer after the I/O thread last looked pays a syscall
+  if (atomic_exchange(&io->wake_pending, 1) == 0) {
+    uint64_t one = 1;
+    if (write(io->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      return WIZ_ERR_SOCKET;
+  }
+  return WIZ_OK;
+}
+
+static void _publish(wiz_bulb_t *bulb) {
+  struct wiz_snapshot *snap = bulb->snapshot;
+  unsigned int seq = atomic_load_explicit(&snap->seq, memory_order_relaxed);
+
+  atomic_store_explicit(&snap->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  memcpy(&snap->state, &bulb->state, sizeof(snap->state));
+  atomic_store_explicit(&snap->seq, seq + 2, memory_order_release);
+}
+
+// runs on the I/O thread: publish before the caller's callback sees the result
+static void _command_done(wiz_bulb_t *bulb, int result,
+                          const wiz_bulb_state_t *state, void *user_data) {
+  io_command_t *cmd = (io_command_t *)user_data;
+
+  _publish(bulb);
+  if (cmd->callback)
+    cmd->callback(bulb, result, state, cmd->user_data);
+  free(cmd);
+}
+
+static void _run_command(wiz_io_t *io, io_command_t *cmd) {
+  int ret;
+
+  if (cmd->kind == IO_APPLY_PILOT)
+    ret = wiz_fleet_apply_pilot(io->fleet, cmd->bulb, &cmd->builder,
+                                _command_done, cmd);
+  else
+    ret = wiz_fleet_update_state(io->fleet, cmd->bulb, _command_done, cmd);
+
+  if (ret != WIZ_OK) {
+    if (cmd->callback)
+      cmd->callback(cmd->bulb, ret, &cmd->bulb->state, cmd->user_data);
+    free(cmd);
+  }
+}
+
+static void *_io_main(void *arg) {
+  wiz_io_t *io = (wiz_io_t *)arg;
+  bool stopping = false;
+
+  struct pollfd fds[2] = {
+      {.fd = wiz_fleet_get_fd(io->fleet), .events = POLLIN},
+      {.fd = io->wake_fd, .events = POLLIN},
+  };
+
+  for (;;) {
+    if (stopping && wiz_fleet_pending(io->fleet) == 0)
+      break;
+
+    if (poll(fds, 2, wiz_fleet_next_timeout(io->fleet)) < 0 && errno != EINTR)
+      break;
+
+    if (fds[1].revents & POLLIN) {
+      uint64_t count;
+      if (read(io->wake_fd, &count, sizeof(count)) < 0) {
+        // nothing to clear
+      }
+    }
+
+    // clear before draining so a push racing with the drain wakes us again
+    atomic_store(&io->wake_pending, 0);
+
+    io_command_t *cmd;
+    while ((cmd = _queue_pop(io)) != NULL) {
+      if (cmd->kind == IO_STOP) {
+        stopping = true;
+        free(cmd);
+        continue;
+      }
+      _run_command(io, cmd);
+    }
+
+    wiz_process_events(io->fleet);
+  }
+
+  return NULL;
+}
+
+// start the I/O thread with a fleet of socket_count pooled sockets
+wiz_io_t *wiz_io_create(int socket_count) {
+  wiz_io_t *io = (wiz_io_t *)calloc(1, sizeof(wiz_io_t));
+  if (!io)
+    return NULL;
+
+  io->fleet = wiz_fleet_create_pool(socket_count > 0 ? socket_count : 1);
+  if (!io->fleet) {
+    free(io);
+    return NULL;
+  }
+
+  io->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (io->wake_fd < 0) {
+    wiz_fleet_destroy(io->fleet);
+    free(io);
+    return NULL;
+  }
+
+  atomic_init(&io->stub.next, NULL);
+  atomic_init(&io->head, &io->stub);
+  io->tail = &io->stub;
+  atomic_init(&io->wake_pending, 0);
+
+  if (pthread_create(&io->thread, NULL, _io_main, io) != 0) {
+    close(io->wake_fd);
+    wiz_fleet_destroy(io->fleet);
+    free(io);
+    return NULL;
+  }
+
+  return io;
+}
+
+// finish every queued command, stop the thread and release the fleet; bulbs
+// from wiz_io_bulb_create() must be destroyed afterwards
+void wiz_io_destroy(wiz_io_t *io) {
+  if (!io)
+    return;
+
+  io_command_t *cmd = (io_command_t *)calloc(1, sizeof(io_command_t));
+  if (cmd) {
+    cmd->kind = IO_STOP;
+    _enqueue(io, cmd);
+  }
+  pthread_join(io->thread, NULL);
+
+  // anything pushed after the stop was never run
+  while ((cmd = _queue_pop(io)) != NULL)
+    free(cmd);
+
+  close(io->wake_fd);
+  wiz_fleet_destroy(io->fleet);
+  free(io);
+}
+
+// create a bulb driven by the I/O thread; safe to call from any thread
+wiz_bulb_t *wiz_io_bulb_create(wiz_io_t *io, const char *ip_address) {
+  if (!io)
+    return NULL;
+
+  struct wiz_snapshot *snap =
+      (struct wiz_snapshot *)calloc(1, sizeof(struct wiz_snapshot));
+  if (!snap)
+    return NULL;
+
+  // picking a pooled socket only reads the fleet
+  wiz_bulb_t *bulb = wiz_bulb_create_shared(io->fleet, ip_address);
+  if (!bulb) {
+    free(snap);
+    return NULL;
+  }
+
+  atomic_init(&snap->seq, 0);
+  bulb->snapshot = snap;
+  return bulb;
+}
+
+static int _submit(wiz_io_t *io, wiz_bulb_t *bulb, io_kind_t kind,
+                   const wiz_pilot_builder_t *builder, wiz_callback_t callback,
+                   void *user_data) {
+  if (!io || !bulb || !bulb->snapshot || bulb->fleet != io->fleet)
+    return WIZ_ERR_INVALID_PARAM;
+
+  io_command_t *cmd = (io_command_t *)malloc(sizeof(io_command_t));
+  if (!cmd)
+    return WIZ_ERR_MALLOC;
+
+  cmd->kind = kind;
+  cmd->bulb = bulb;
+  if (builder)
+    cmd->builder = *builder;
+  cmd->callback = callback;
+  cmd->user_data = user_data;
+
+  return _enqueue(io, cmd);
+}
+
+// queue a setPilot from any thread; callback runs on the I/O thread
+int wiz_io_apply_pilot(wiz_io_t *io, wiz_bulb_t *bulb,
+                       const wiz_pilot_builder_t *builder,
+                       wiz_callback_t callback, void *user_data) {
+  if (!builder)
+    return WIZ_ERR_INVALID_PARAM;
+
+  return _submit(io, bulb, IO_APPLY_PILOT, builder, callback, user_data);
+}
+
+// queue a getPilot from any thread; callback runs on the I/O thread
+int wiz_io_update_state(wiz_io_t *io, wiz_bulb_t *bulb,
+                        wiz_callback_t callback, void *user_data) {
+  return _submit(io, bulb, IO_UPDATE_STATE, NULL, callback, user_data);
+}
+
+// copy the last published state without blocking; safe from any thread
+int wiz_io_get_state(const wiz_bulb_t *bulb, wiz_bulb_state_t *state) {
+  if (!bulb || !state || !bulb->snapshot)
+    return WIZ_ERR_INVALID_PARAM;
+
+  struct wiz_snapshot *snap = bulb->snapshot;
+  for (;;) {
+    unsigned int before = atomic_load_explicit(&snap->seq, memory_order_acquire);
+    if (before & 1)
+      continue; // writer in progress
+
+    memcpy(state, &snap->state, sizeof(*state));
+    atomic_thread_fence(memory_order_acquire);
+
+    if (atomic_load_explicit(&snap->seq, memory_order_relaxed) == before)
+      return WIZ_OK;
+  }
+}
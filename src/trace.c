@@ -0,0 +1,101 @@
+#include "../include/cwiz.h"
+#include "trace.h"
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+// optional transport tracing; the trace points in the I/O paths expand to
+// calls of wiz_trace_emit() only when built with CWIZ_TRACE
+
+// the hook is published through a seqlock so that an event never pairs one
+// setter's callback with another's user data; setters take the lock, the
+// trace points only read
+static struct {
+  unsigned int seq; // odd while a setter is writing
+  wiz_trace_callback_t callback;
+  void *user_data;
+} trace_hook;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool wiz_trace_enabled(void) {
+#ifdef CWIZ_TRACE
+  return true;
+#else
+  return false;
+#endif
+}
+
+// NULL detaches the hook. Safe to call while I/O runs on other threads.
+void wiz_trace_set_callback(wiz_trace_callback_t callback, void *user_data) {
+  pthread_mutex_lock(&trace_lock);
+  unsigned int seq = __atomic_load_n(&trace_hook.seq, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&trace_hook.seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&trace_hook.callback, callback, __ATOMIC_RELAXED);
+  __atomic_store_n(&trace_hook.user_data, user_data, __ATOMIC_RELAXED);
+  __atomic_store_n(&trace_hook.seq, seq + 2, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&trace_lock);
+}
+
+// a consistent callback and user data pair
+static wiz_trace_callback_t _load_hook(void **user_data) {
+  for (;;) {
+    unsigned int seq = __atomic_load_n(&trace_hook.seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      continue;
+
+    wiz_trace_callback_t callback =
+        __atomic_load_n(&trace_hook.callback, __ATOMIC_RELAXED);
+    void *data = __atomic_load_n(&trace_hook.user_data, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&trace_hook.seq, __ATOMIC_RELAXED) == seq) {
+      *user_data = data;
+      return callback;
+    }
+  }
+}
+
+// copy the "method" member of a datagram, without validating the rest
+static void _copy_method(const char *json, char *out, size_t size) {
+  out[0] = '\0';
+  const char *p = json ? strstr(json, "\"method\"") : NULL;
+  if (!p)
+    return;
+
+  p += 8;
+  while (*p == ' ' || *p == ':')
+    p++;
+  if (*p++ != '"')
+    return;
+
+  size_t len = 0;
+  while (p[len] && p[len] != '"' && len < size - 1)
+    len++;
+  memcpy(out, p, len);
+  out[len] = '\0';
+}
+
+void wiz_trace_emit(wiz_trace_kind_t kind, const struct sockaddr_in *addr,
+                    const char *message, int attempt, int result) {
+  void *user_data;
+  wiz_trace_callback_t callback = _load_hook(&user_data);
+  if (!callback)
+    return;
+
+  wiz_trace_event_t event;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  event.kind = kind;
+  event.time_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+  if (addr)
+    event.addr = *addr;
+  else
+    memset(&event.addr, 0, sizeof(event.addr));
+  _copy_method(message, event.method, sizeof(event.method));
+  event.attempt = attempt;
+  event.result = result;
+
+  callback(&event, user_data);
+}
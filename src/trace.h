@@ -0,0 +1,17 @@
+#ifndef CWIZ_TRACE_H
+#define CWIZ_TRACE_H
+
+#include "../include/cwiz.h"
+
+// trace points of the I/O paths; they call wiz_trace_emit() in a
+// `make TRACE=1` build and compile to nothing otherwise
+#ifdef CWIZ_TRACE
+void wiz_trace_emit(wiz_trace_kind_t kind, const struct sockaddr_in *addr,
+                    const char *message, int attempt, int result);
+#define WIZ_TRACE(kind, addr, message, attempt, result)                        \
+  wiz_trace_emit(kind, addr, message, attempt, result)
+#else
+#define WIZ_TRACE(kind, addr, message, attempt, result) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,469 @@
+// optional io_uring transport, built with `make IO_URING=1`; without it (or
+// when the kernel refuses to set up a ring) the plain socket calls are used
+#ifdef CWIZ_IO_URING
+
+#include "../include/cwiz.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// ring for the blocking exchange path, one per thread
+#define URING_THREAD_ENTRIES 8
+
+// tags for the blocking exchange chain
+#define URING_TAG_SEND 1
+#define URING_TAG_RECV 2
+#define URING_TAG_TIMEOUT 3
+#define URING_TAG_CANCEL 4
+
+typedef struct wiz_uring {
+  int fd;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sq_local_tail; // prepared, published on submit
+  unsigned sq_submitted;  // published and handed to the kernel
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  // provided buffer ring for multishot receives
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_size;
+  char *buffers;
+  unsigned buf_count;
+  unsigned buf_size;
+  uint16_t buf_group;
+} wiz_uring_t;
+
+static int _setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int _enter(int fd, unsigned to_submit, unsigned min_complete,
+                  unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      NULL, 0);
+}
+
+static int _register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+void wiz_uring_destroy(wiz_uring_t *ring) {
+  if (!ring)
+    return;
+
+  if (ring->buf_ring)
+    munmap(ring->buf_ring, ring->buf_ring_size);
+  free(ring->buffers);
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  free(ring);
+}
+
+// NULL when io_uring is unavailable, e.g. disabled by sysctl or seccomp
+wiz_uring_t *wiz_uring_create(unsigned entries, unsigned cq_entries) {
+  wiz_uring_t *ring = (wiz_uring_t *)calloc(1, sizeof(wiz_uring_t));
+  if (!ring)
+    return NULL;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  if (cq_entries > entries) {
+    p.flags |= IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+  }
+
+  ring->fd = _setup(entries, &p);
+  if (ring->fd < 0) {
+    free(ring);
+    return NULL;
+  }
+
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    wiz_uring_destroy(ring);
+    return NULL;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      wiz_uring_destroy(ring);
+      return NULL;
+    }
+  }
+
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe *)mmap(
+      NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    wiz_uring_destroy(ring);
+    return NULL;
+  }
+
+  char *sq = (char *)ring->sq_ring;
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_entries = *(unsigned *)(sq + p.sq_off.ring_entries);
+  ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+  ring->sq_local_tail = *ring->sq_tail;
+  ring->sq_submitted = ring->sq_local_tail;
+
+  char *cq = (char *)ring->cq_ring;
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  return ring;
+}
+
+int wiz_uring_fd(const wiz_uring_t *ring) {
+  return ring->fd;
+}
+
+// next free submission entry, cleared; NULL when the queue is full
+struct io_uring_sqe *wiz_uring_get_sqe(wiz_uring_t *ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sq_local_tail - head >= ring->sq_entries)
+    return NULL;
+
+  unsigned index = ring->sq_local_tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  ring->sq_local_tail++;
+  return sqe;
+}
+
+// hand every prepared entry to the kernel in one call and optionally wait for
+// wait_nr completions
+int wiz_uring_submit(wiz_uring_t *ring, unsigned wait_nr) {
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+  unsigned pending = ring->sq_local_tail - ring->sq_submitted;
+  if (pending == 0 && wait_nr == 0)
+    return 0;
+
+  for (;;) {
+    int ret = _enter(ring->fd, pending, wait_nr,
+                     wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    if (ret >= 0) {
+      ring->sq_submitted += (unsigned)ret;
+      return ret;
+    }
+    if (errno != EINTR)
+      return WIZ_ERR_SOCKET;
+  }
+}
+
+// oldest unseen completion, NULL when there is none
+struct io_uring_cqe *wiz_uring_peek_cqe(wiz_uring_t *ring) {
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void wiz_uring_cqe_seen(wiz_uring_t *ring) {
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// register count buffers of size bytes as provided-buffer group `group`;
+// the kernel picks one per received datagram
+int wiz_uring_setup_buffers(wiz_uring_t *ring, uint16_t group, unsigned count,
+                            unsigned size) {
+  ring->buf_ring_size = count * sizeof(struct io_uring_buf);
+  void *mem = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return WIZ_ERR_MALLOC;
+
+  ring->buffers = (char *)malloc((size_t)count * size);
+  if (!ring->buffers) {
+    munmap(mem, ring->buf_ring_size);
+    return WIZ_ERR_MALLOC;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)mem;
+  reg.ring_entries = count;
+  reg.bgid = group;
+  if (_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    munmap(mem, ring->buf_ring_size);
+    free(ring->buffers);
+    ring->buffers = NULL;
+    return WIZ_ERR_SOCKET;
+  }
+
+  ring->buf_ring = (struct io_uring_buf_ring *)mem;
+  ring->buf_count = count;
+  ring->buf_size = size;
+  ring->buf_group = group;
+
+  for (unsigned i = 0; i < count; i++) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[i];
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)i * size);
+    buf->len = size;
+    buf->bid = (uint16_t)i;
+  }
+  __atomic_store_n(&ring->buf_ring->tail, (uint16_t)count, __ATOMIC_RELEASE);
+  return WIZ_OK;
+}
+
+char *wiz_uring_buffer(wiz_uring_t *ring, unsigned bid) {
+  return ring->buffers + (size_t)bid * ring->buf_size;
+}
+
+// give a provided buffer back to the kernel once its datagram is handled
+void wiz_uring_recycle(wiz_uring_t *ring, unsigned bid) {
+  uint16_t tail = ring->buf_ring->tail;
+  struct io_uring_buf *buf =
+      &ring->buf_ring->bufs[tail & (ring->buf_count - 1)];
+  buf->addr = (uint64_t)(uintptr_t)wiz_uring_buffer(ring, bid);
+  buf->len = ring->buf_size;
+  buf->bid = (uint16_t)bid;
+  __atomic_store_n(&ring->buf_ring->tail, (uint16_t)(tail + 1),
+                   __ATOMIC_RELEASE);
+}
+
+// arm a multishot recvmsg on fd drawing from the provided buffers; msg only
+// describes the layout (name length) and must outlive the request
+int wiz_uring_recv_multishot(wiz_uring_t *ring, int fd, struct msghdr *msg,
+                             uint64_t user_data) {
+  struct io_uring_sqe *sqe = wiz_uring_get_sqe(ring);
+  if (!sqe)
+    return WIZ_ERR_MALLOC;
+
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)msg;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = ring->buf_group;
+  sqe->user_data = user_data;
+  return WIZ_OK;
+}
+
+void wiz_uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                            const struct msghdr *msg, uint64_t user_data) {
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_DONTWAIT;
+  sqe->user_data = user_data;
+}
+
+// blocking exchange
+
+static pthread_key_t thread_ring_key;
+static pthread_once_t thread_ring_once = PTHREAD_ONCE_INIT;
+
+static void _thread_ring_free(void *ring) {
+  wiz_uring_destroy((wiz_uring_t *)ring);
+}
+
+static void _thread_ring_init(void) {
+  pthread_key_create(&thread_ring_key, _thread_ring_free);
+}
+
+// set when the thread's ring cannot be created or stopped accepting
+// io_uring_enter; the thread then stays on plain sockets
+static __thread int unavailable;
+
+// lazily created ring for the calling thread, NULL to fall back to sockets
+static wiz_uring_t *_thread_ring(void) {
+  if (unavailable)
+    return NULL;
+
+  pthread_once(&thread_ring_once, _thread_ring_init);
+  wiz_uring_t *ring = (wiz_uring_t *)pthread_getspecific(thread_ring_key);
+  if (!ring) {
+    ring = wiz_uring_create(URING_THREAD_ENTRIES, 0);
+    if (!ring || pthread_setspecific(thread_ring_key, ring) != 0) {
+      wiz_uring_destroy(ring);
+      unavailable = 1;
+      return NULL;
+    }
+  }
+  return ring;
+}
+
+// ask the kernel to cancel the entries of an exchange chain; returns false if
+// the request could not be submitted
+static bool _cancel_chain(wiz_uring_t *ring, bool has_send) {
+  static const uint64_t tags[] = {URING_TAG_SEND, URING_TAG_RECV,
+                                  URING_TAG_TIMEOUT};
+  for (int i = has_send ? 0 : 1; i < 3; i++) {
+    struct io_uring_sqe *sqe = wiz_uring_get_sqe(ring);
+    if (!sqe)
+      break;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = tags[i];
+    sqe->user_data = URING_TAG_CANCEL;
+  }
+  return wiz_uring_submit(ring, 0) >= 0;
+}
+
+// send (when message is non-NULL) and receive one datagram with a timeout,
+// as one linked chain in a single io_uring_enter: sendmsg -> recvmsg ->
+// link timeout. Returns the datagram length, 0 on timeout, WIZ_ERR_SOCKET on
+// failure, or WIZ_ERR_CONNECTION when no ring is available.
+int wiz_uring_exchange(int fd, const char *message, size_t message_len,
+                       const struct sockaddr_in *to, char *buffer, size_t size,
+                       struct sockaddr_in *from, unsigned int timeout_ms) {
+  wiz_uring_t *ring = _thread_ring();
+  if (!ring)
+    return WIZ_ERR_CONNECTION;
+
+  struct iovec send_iov = {(void *)message, message_len};
+  struct msghdr send_msg;
+  memset(&send_msg, 0, sizeof(send_msg));
+  send_msg.msg_name = (void *)to;
+  send_msg.msg_namelen = sizeof(*to);
+  send_msg.msg_iov = &send_iov;
+  send_msg.msg_iovlen = 1;
+
+  struct iovec recv_iov = {buffer, size};
+  struct msghdr recv_msg;
+  memset(&recv_msg, 0, sizeof(recv_msg));
+  recv_msg.msg_name = from;
+  recv_msg.msg_namelen = sizeof(*from);
+  recv_msg.msg_iov = &recv_iov;
+  recv_msg.msg_iovlen = 1;
+
+  struct __kernel_timespec ts = {
+      .tv_sec = timeout_ms / 1000,
+      .tv_nsec = (long long)(timeout_ms % 1000) * 1000000,
+  };
+
+  unsigned expected = 0;
+  struct io_uring_sqe *sqe;
+
+  if (message) {
+    sqe = wiz_uring_get_sqe(ring);
+    wiz_uring_prep_sendmsg(sqe, fd, &send_msg, URING_TAG_SEND);
+    sqe->msg_flags = 0;
+    sqe->flags = IOSQE_IO_LINK;
+    expected++;
+  }
+
+  sqe = wiz_uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)&recv_msg;
+  sqe->len = 1;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = URING_TAG_RECV;
+  expected++;
+
+  sqe = wiz_uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_LINK_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t)(uintptr_t)&ts;
+  sqe->len = 1;
+  sqe->user_data = URING_TAG_TIMEOUT;
+  expected++;
+
+  // every entry of the chain completes (possibly as cancelled), and all of
+  // them point into this stack frame, so collect them all before returning
+  int send_result = 0;
+  int recv_result = -ETIME;
+  unsigned seen = 0;
+
+  if (wiz_uring_submit(ring, expected) < 0) {
+    // nothing reached the kernel: take the chain back
+    ring->sq_local_tail = ring->sq_submitted;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    return WIZ_ERR_SOCKET;
+  }
+
+  bool broken = false;
+  while (seen < expected) {
+    struct io_uring_cqe *cqe = wiz_uring_peek_cqe(ring);
+    if (!cqe) {
+      if (!broken && wiz_uring_submit(ring, 1) >= 0)
+        continue;
+      if (!broken) {
+        // waiting failed with the chain still in the kernel, pointing into
+        // this frame: cancel it, retire the ring for this thread, and wait
+        // the chain out by watching the completion queue. The link timeout
+        // bounds the wait even when the cancel cannot be submitted.
+        broken = true;
+        unavailable = 1;
+        _cancel_chain(ring, message != NULL);
+      }
+      struct timespec pause = {0, 1000000};
+      nanosleep(&pause, NULL);
+      continue;
+    }
+    if (cqe->user_data == URING_TAG_CANCEL) {
+      wiz_uring_cqe_seen(ring);
+      continue;
+    }
+    if (cqe->user_data == URING_TAG_SEND)
+      send_result = cqe->res;
+    else if (cqe->user_data == URING_TAG_RECV)
+      recv_result = cqe->res;
+    wiz_uring_cqe_seen(ring);
+    seen++;
+  }
+
+  if (send_result < 0 || broken)
+    return WIZ_ERR_SOCKET;
+  if (recv_result == -ECANCELED || recv_result == -ETIME ||
+      recv_result == -EINTR)
+    return 0;
+  if (recv_result < 0)
+    return WIZ_ERR_SOCKET;
+  return recv_result;
+}
+
+#endif // CWIZ_IO_URING
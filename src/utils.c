@@ -2,6 +2,7 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 const char *wiz_strerror(int error) {
   switch (error) {
@@ -21,6 +22,10 @@ const char *wiz_strerror(int error) {
     return "Memory allocation failed";
   case WIZ_ERR_CONNECTION:
     return "Connection error";
+  case WIZ_ERR_IO:
+    return "File I/O error";
+  case WIZ_ERR_FORMAT:
+    return "Invalid file format";
   default:
     return "Unknown error";
   }
@@ -81,3 +86,10 @@ int wiz_hex_to_rgb(const char *hex_color, wiz_rgb_t *rgb) {
 
   return WIZ_OK;
 }
+
+// monotonic clock in milliseconds, used for retry and timer deadlines
+uint64_t wiz_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,249 @@
+// Reply matching against the loopback simulator (build/wizsim, started and
+// stopped by this program). Every reply is sent twice and every answer that
+// carried an id is followed, a little later, by a copy without it; a quarter
+// of the bulbs run firmware that never echoes ids at all. Each round sends a
+// setPilot and a getPilot, blocking and on a fleet. The stray copy of one
+// getPilot lands while the next is in flight, so a reply matched on its
+// method alone shows up as the colour of the round before. The first round
+// opens with a second setPilot, queued behind the first while the
+// duplicate of its ack arrives. Exits non-zero when any check fails.
+
+#include "cwiz.h"
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SIM_PATH "build/wizsim"
+#define SIM_BULBS 32
+#define SIM_FIRST 0x7f000301u // 127.0.3.1
+
+// a round trip takes SIM_LATENCY ms, so a copy held back by SIM_STRAY ms
+// turns up halfway through the second exchange after the one it answers
+#define SIM_LATENCY "10"
+#define SIM_STRAY "15"
+
+#define BLOCKING_BULBS 4
+#define ROUNDS 12
+
+static pid_t sim_pid;
+
+static void bulb_ip(int index, char *ip) {
+  uint32_t addr = SIM_FIRST + (uint32_t)index;
+  snprintf(ip, 16, "%u.%u.%u.%u", addr >> 24, (addr >> 16) & 0xff,
+           (addr >> 8) & 0xff, addr & 0xff);
+}
+
+static void sim_stop(void) {
+  if (sim_pid > 0) {
+    kill(sim_pid, SIGTERM);
+    waitpid(sim_pid, NULL, 0);
+    sim_pid = 0;
+  }
+}
+
+static int sim_start(void) {
+  const char *path = getenv("WIZSIM");
+  if (!path)
+    path = SIM_PATH;
+
+  char count[16], first[16];
+  snprintf(count, sizeof(count), "%d", SIM_BULBS);
+  bulb_ip(0, first);
+
+  sim_pid = fork();
+  if (sim_pid < 0)
+    return -1;
+  if (sim_pid == 0) {
+    execl(path, path, "-q", "-n", count, "-a", first, "-l",
+          "const:" SIM_LATENCY, "-u", "100", "-D", "100", "-R", SIM_STRAY,
+          "-i", "25", "-t", "120", (char *)NULL);
+    perror(path);
+    _exit(127);
+  }
+
+  // ready once the first bulb answers
+  wiz_bulb_t *bulb = wiz_bulb_create(first);
+  if (!bulb)
+    return -1;
+  for (int i = 0; i < 50; i++) {
+    if (waitpid(sim_pid, NULL, WNOHANG) == sim_pid) {
+      sim_pid = 0;
+      break;
+    }
+    if (wiz_bulb_update_state(bulb) == WIZ_OK) {
+      wiz_bulb_destroy(bulb);
+      return 0;
+    }
+  }
+  wiz_bulb_destroy(bulb);
+  return -1;
+}
+
+// the colour a bulb is set to in a round; round -1 is the extra opening set
+static wiz_rgb_t round_colour(int bulb, int round) {
+  wiz_rgb_t rgb = {(uint8_t)(round + 2), 100, (uint8_t)bulb};
+  return rgb;
+}
+
+static int same_colour(const wiz_rgb_t *a, const wiz_rgb_t *b) {
+  return a->r == b->r && a->g == b->g && a->b == b->b;
+}
+
+static int check_blocking(void) {
+  int failures = 0;
+
+  for (int i = 0; i < BLOCKING_BULBS; i++) {
+    char ip[16];
+    bulb_ip(i, ip);
+    wiz_bulb_t *bulb = wiz_bulb_create(ip);
+    if (!bulb)
+      return 1;
+
+    for (int round = -1; round < ROUNDS; round++) {
+      wiz_rgb_t expected = round_colour(i, round);
+      int ret = wiz_bulb_set_rgb(bulb, expected.r, expected.g, expected.b);
+      if (ret != WIZ_OK) {
+        fprintf(stderr, "replies: %s setPilot failed: %d\n", ip, ret);
+        failures++;
+      }
+      if (round < 0)
+        continue;
+
+      ret = wiz_bulb_update_state(bulb);
+      if (ret != WIZ_OK) {
+        fprintf(stderr, "replies: %s getPilot failed: %d\n", ip, ret);
+        failures++;
+      } else if (!same_colour(&bulb->state.rgb, &expected)) {
+        fprintf(stderr, "replies: %s round %d reported r=%d, sent r=%d\n", ip,
+                round, bulb->state.rgb.r, expected.r);
+        failures++;
+      }
+    }
+
+    printf("{\"check\":\"blocking\",\"bulb\":\"%s\",\"echoes_id\":%s,"
+           "\"stale\":%u}\n",
+           ip, bulb->echoes_id ? "true" : "false", bulb->replies.stale_replies);
+    wiz_bulb_destroy(bulb);
+  }
+
+  return failures != 0;
+}
+
+typedef struct {
+  int bulb;
+  int round;
+} fleet_expect_t;
+
+static int fleet_done;
+static int fleet_failures;
+
+static void on_set(wiz_bulb_t *bulb, int result, const wiz_bulb_state_t *state,
+                   void *user_data) {
+  (void)state;
+  (void)user_data;
+  fleet_done++;
+  if (result != WIZ_OK) {
+    fprintf(stderr, "replies: %s setPilot failed: %d\n", bulb->ip_address,
+            result);
+    fleet_failures++;
+  }
+}
+
+static void on_get(wiz_bulb_t *bulb, int result, const wiz_bulb_state_t *state,
+                   void *user_data) {
+  const fleet_expect_t *expect = (const fleet_expect_t *)user_data;
+  wiz_rgb_t expected = round_colour(expect->bulb, expect->round);
+
+  fleet_done++;
+  if (result != WIZ_OK) {
+    fprintf(stderr, "replies: %s getPilot failed: %d\n", bulb->ip_address,
+            result);
+    fleet_failures++;
+  } else if (!same_colour(&state->rgb, &expected)) {
+    fprintf(stderr, "replies: %s round %d reported r=%d, sent r=%d\n",
+            bulb->ip_address, expect->round, state->rgb.r, expected.r);
+    fleet_failures++;
+  }
+}
+
+static int check_fleet(void) {
+  static fleet_expect_t expect[SIM_BULBS][ROUNDS];
+  wiz_bulb_t *bulbs[SIM_BULBS];
+  wiz_fleet_t *fleet = wiz_fleet_create();
+  if (!fleet)
+    return 1;
+
+  // every round of every bulb is queued up front, so each reply races the
+  // strays of the requests before it; a setPilot always follows a getPilot
+  // or the one in flight, so none of them are coalesced
+  int submitted = 0;
+  for (int i = 0; i < SIM_BULBS; i++) {
+    char ip[16];
+    bulb_ip(i, ip);
+    bulbs[i] = wiz_bulb_create(ip);
+    if (!bulbs[i])
+      return 1;
+
+    for (int round = -1; round < ROUNDS; round++) {
+      wiz_rgb_t rgb = round_colour(i, round);
+      wiz_pilot_builder_t builder = {0};
+      wiz_pilot_builder_set_rgb(&builder, rgb.r, rgb.g, rgb.b);
+      if (wiz_fleet_apply_pilot(fleet, bulbs[i], &builder, on_set, NULL) ==
+          WIZ_OK)
+        submitted++;
+      if (round < 0)
+        continue;
+
+      expect[i][round] = (fleet_expect_t){i, round};
+      if (wiz_fleet_update_state(fleet, bulbs[i], on_get,
+                                 &expect[i][round]) == WIZ_OK)
+        submitted++;
+    }
+  }
+  wiz_fleet_run(fleet);
+
+  int echoing = 0;
+  uint32_t stale = 0;
+  for (int i = 0; i < SIM_BULBS; i++) {
+    echoing += bulbs[i]->echoes_id;
+    stale += bulbs[i]->replies.stale_replies;
+  }
+  printf("{\"check\":\"fleet\",\"bulbs\":%d,\"echoing\":%d,\"requests\":%d,"
+         "\"completed\":%d,\"stale\":%u,\"failures\":%d}\n",
+         SIM_BULBS, echoing, submitted, fleet_done, stale, fleet_failures);
+
+  // both kinds of firmware have to be in the mix for the run to mean much
+  int failed = fleet_failures != 0 ||
+               submitted != SIM_BULBS * (ROUNDS * 2 + 1) || fleet_done != submitted;
+  if (echoing == 0 || echoing == SIM_BULBS) {
+    fprintf(stderr, "replies: %d of %d bulbs echo ids\n", echoing, SIM_BULBS);
+    failed = 1;
+  }
+
+  for (int i = 0; i < SIM_BULBS; i++)
+    wiz_bulb_destroy(bulbs[i]);
+  wiz_fleet_destroy(fleet);
+  return failed;
+}
+
+int main(void) {
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  if (sim_start() != 0) {
+    fprintf(stderr, "replies: simulator did not come up (is port 38899 free? "
+                    "build it with 'make sim')\n");
+    sim_stop();
+    return 1;
+  }
+
+  int failed = 0;
+  failed |= check_blocking();
+  failed |= check_fleet();
+
+  sim_stop();
+  return failed;
+}
@@ -0,0 +1,795 @@
+// Loopback WiZ simulator: one UDP socket on port 38899 answers for a block of
+// consecutive 127.x addresses, one emulated bulb per address. Replies leave
+// from the bulb's own address (IP_PKTINFO), so the library cannot tell them
+// from real hardware. Latency, loss, reordering, duplicates, firmware that
+// does not echo request ids and dead devices are configurable; see usage().
+
+#define _GNU_SOURCE // ppoll, in_pktinfo
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_PORT 38899
+#define SIM_PUSH_PORT 38900
+#define SIM_MESSAGE_MAX 1024
+#define SIM_SOCKET_BUFFER (8 << 20)
+
+typedef enum { LAT_CONST, LAT_UNIFORM, LAT_EXP, LAT_PARETO } latency_kind_t;
+
+// reply delay in milliseconds
+typedef struct {
+  latency_kind_t kind;
+  double a; // const: delay, uniform: min, exp: min, pareto: scale (minimum)
+  double b; // uniform: max, exp: mean added to min, pareto: shape
+} latency_t;
+
+typedef struct {
+  bool dead;
+  bool no_id; // firmware that never echoes the request id
+  bool state;
+  int r, g, b, c, w;
+  int dimming;
+  int temp;
+  int scene_id;
+  int speed;
+  uint32_t phone_ip; // syncPilot target after registration, network order
+} sim_bulb_t;
+
+// a datagram waiting for its delivery time
+typedef struct {
+  uint64_t due_us;
+  uint64_t seq; // keeps equal deadlines in arrival order
+  int pending;  // index into the payload pool
+} sim_timer_t;
+
+typedef struct {
+  struct sockaddr_in to;
+  uint32_t from; // source address, network order
+  size_t len;
+  char data[SIM_MESSAGE_MAX];
+  int next; // free list
+} sim_pending_t;
+
+typedef struct {
+  uint64_t requests;
+  uint64_t replies;
+  uint64_t pushes;
+  uint64_t lost;
+  uint64_t dead;
+  uint64_t duplicated;
+  uint64_t stripped;
+  uint64_t reordered;
+  uint64_t ignored;
+} sim_stats_t;
+
+static struct {
+  int sock;
+  sim_bulb_t *bulbs;
+  int count;
+  uint32_t first; // first bulb address, host order
+
+  latency_t latency;
+  double loss;      // per datagram, either direction
+  double reorder;   // probability a reply is held back
+  double reorder_ms; // extra delay for held-back replies
+  double duplicate; // probability a reply is sent twice
+  double stripped;  // probability a late copy without the id follows a reply
+  uint64_t rng;
+
+  sim_timer_t *timers;
+  int timer_count;
+  int timer_capacity;
+  sim_pending_t *pending;
+  int pending_capacity;
+  int pending_free;
+  uint64_t seq;
+
+  sim_stats_t stats;
+  bool quiet;
+} sim;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// xorshift64*, seeded from the command line so runs are repeatable
+static double rand_unit(void) {
+  sim.rng ^= sim.rng >> 12;
+  sim.rng ^= sim.rng << 25;
+  sim.rng ^= sim.rng >> 27;
+  uint64_t x = sim.rng * 2685821657736338717ULL;
+  return (double)(x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static bool chance(double p) {
+  return p > 0 && rand_unit() < p;
+}
+
+static double sample_latency_ms(void) {
+  const latency_t *l = &sim.latency;
+  switch (l->kind) {
+  case LAT_UNIFORM:
+    return l->a + (l->b - l->a) * rand_unit();
+  case LAT_EXP:
+    return l->a - l->b * log(1.0 - rand_unit());
+  case LAT_PARETO:
+    return l->a / pow(1.0 - rand_unit(), 1.0 / l->b);
+  default:
+    return l->a;
+  }
+}
+
+static int parse_latency(const char *spec, latency_t *out) {
+  double a = 0, b = 0;
+  if (sscanf(spec, "const:%lf", &a) == 1) {
+    *out = (latency_t){LAT_CONST, a, 0};
+  } else if (sscanf(spec, "uniform:%lf:%lf", &a, &b) == 2 && b >= a) {
+    *out = (latency_t){LAT_UNIFORM, a, b};
+  } else if (sscanf(spec, "exp:%lf:%lf", &a, &b) == 2) {
+    *out = (latency_t){LAT_EXP, a, b};
+  } else if (sscanf(spec, "pareto:%lf:%lf", &a, &b) == 2 && a > 0 && b > 0) {
+    *out = (latency_t){LAT_PARETO, a, b};
+  } else {
+    return -1;
+  }
+  return a >= 0 ? 0 : -1;
+}
+
+// bulb at a destination address, -1 when the address is not one of ours
+static int bulb_index(uint32_t addr) {
+  uint32_t host = ntohl(addr);
+  if (host < sim.first || host - sim.first >= (uint32_t)sim.count)
+    return -1;
+  return (int)(host - sim.first);
+}
+
+static uint32_t bulb_addr(int index) {
+  return htonl(sim.first + (uint32_t)index);
+}
+
+static void bulb_mac(int index, char *mac) {
+  snprintf(mac, 13, "a8bb50%06x", (unsigned int)index & 0xffffff);
+}
+
+// delivery queue: min-heap of deadlines over a pool of payloads
+
+static int pending_alloc(void) {
+  if (sim.pending_free < 0) {
+    int capacity = sim.pending_capacity ? sim.pending_capacity * 2 : 256;
+    sim_pending_t *pending = (sim_pending_t *)realloc(
+        sim.pending, (size_t)capacity * sizeof(sim_pending_t));
+    if (!pending)
+      return -1;
+    for (int i = sim.pending_capacity; i < capacity; i++)
+      pending[i].next = i + 1 < capacity ? i + 1 : -1;
+    sim.pending_free = sim.pending_capacity;
+    sim.pending = pending;
+    sim.pending_capacity = capacity;
+  }
+
+  int index = sim.pending_free;
+  sim.pending_free = sim.pending[index].next;
+  return index;
+}
+
+static void pending_free(int index) {
+  sim.pending[index].next = sim.pending_free;
+  sim.pending_free = index;
+}
+
+static bool timer_before(const sim_timer_t *a, const sim_timer_t *b) {
+  return a->due_us < b->due_us || (a->due_us == b->due_us && a->seq < b->seq);
+}
+
+static int timer_push(uint64_t due_us, int pending) {
+  if (sim.timer_count == sim.timer_capacity) {
+    int capacity = sim.timer_capacity ? sim.timer_capacity * 2 : 256;
+    sim_timer_t *timers = (sim_timer_t *)realloc(
+        sim.timers, (size_t)capacity * sizeof(sim_timer_t));
+    if (!timers)
+      return -1;
+    sim.timers = timers;
+    sim.timer_capacity = capacity;
+  }
+
+  sim_timer_t timer = {due_us, sim.seq++, pending};
+  int i = sim.timer_count++;
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!timer_before(&timer, &sim.timers[parent]))
+      break;
+    sim.timers[i] = sim.timers[parent];
+    i = parent;
+  }
+  sim.timers[i] = timer;
+  return 0;
+}
+
+static void timer_pop(void) {
+  sim_timer_t last = sim.timers[--sim.timer_count];
+  int i = 0;
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= sim.timer_count)
+      break;
+    if (child + 1 < sim.timer_count &&
+        timer_before(&sim.timers[child + 1], &sim.timers[child]))
+      child++;
+    if (!timer_before(&sim.timers[child], &last))
+      break;
+    sim.timers[i] = sim.timers[child];
+    i = child;
+  }
+  if (sim.timer_count > 0)
+    sim.timers[i] = last;
+}
+
+// queue a datagram from `from` after a sampled delay; loss, reordering and
+// duplication are decided here
+static void schedule(uint32_t from, const struct sockaddr_in *to,
+                     const char *data, size_t len, uint64_t now) {
+  if (chance(sim.loss)) {
+    sim.stats.lost++;
+    return;
+  }
+
+  int copies = 1;
+  if (chance(sim.duplicate)) {
+    copies = 2;
+    sim.stats.duplicated++;
+  }
+
+  for (int i = 0; i < copies; i++) {
+    int index = pending_alloc();
+    if (index < 0)
+      return;
+
+    sim_pending_t *p = &sim.pending[index];
+    p->to = *to;
+    p->from = from;
+    p->len = len;
+    memcpy(p->data, data, len);
+
+    double delay_ms = sample_latency_ms();
+    if (chance(sim.reorder)) {
+      delay_ms += sim.reorder_ms;
+      sim.stats.reordered++;
+    }
+
+    if (timer_push(now + (uint64_t)(delay_ms * 1000.0), index) < 0)
+      pending_free(index);
+  }
+}
+
+// send one datagram with the bulb's address as its source
+static void transmit(const sim_pending_t *p) {
+  struct iovec iov = {(void *)p->data, p->len};
+  char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+  memset(control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = (void *)&p->to;
+  msg.msg_namelen = sizeof(p->to);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = IPPROTO_IP;
+  cmsg->cmsg_type = IP_PKTINFO;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+  struct in_pktinfo *info = (struct in_pktinfo *)CMSG_DATA(cmsg);
+  info->ipi_spec_dst.s_addr = p->from;
+
+  if (sendmsg(sim.sock, &msg, MSG_DONTWAIT) < 0 && !sim.quiet)
+    perror("wizsim: sendmsg");
+}
+
+static void deliver_due(uint64_t now) {
+  while (sim.timer_count > 0 && sim.timers[0].due_us <= now) {
+    int index = sim.timers[0].pending;
+    timer_pop();
+    transmit(&sim.pending[index]);
+    pending_free(index);
+  }
+}
+
+// minimal request scanning: the library's messages are flat and
+// well-formed, so looking members up by their quoted key is enough
+
+static const char *find_value(const char *json, const char *key) {
+  char pattern[32];
+  int n = snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+  const char *p = strstr(json, pattern);
+  if (!p)
+    return NULL;
+  p += n;
+  while (*p == ' ')
+    p++;
+  return p;
+}
+
+static bool find_int(const char *json, const char *key, long *out) {
+  const char *p = find_value(json, key);
+  if (!p || !(*p == '-' || (*p >= '0' && *p <= '9')))
+    return false;
+  *out = strtol(p, NULL, 10);
+  return true;
+}
+
+static bool find_bool(const char *json, const char *key, bool *out) {
+  const char *p = find_value(json, key);
+  if (!p)
+    return false;
+  if (strncmp(p, "true", 4) == 0)
+    *out = true;
+  else if (strncmp(p, "false", 5) == 0)
+    *out = false;
+  else
+    return false;
+  return true;
+}
+
+static bool find_string(const char *json, const char *key, char *out,
+                        size_t size) {
+  const char *p = find_value(json, key);
+  if (!p || *p != '"')
+    return false;
+  p++;
+  size_t len = 0;
+  while (p[len] && p[len] != '"')
+    len++;
+  if (len >= size)
+    len = size - 1;
+  memcpy(out, p, len);
+  out[len] = '\0';
+  return true;
+}
+
+static int clamp(long v, int lo, int hi) {
+  return v < lo ? lo : v > hi ? hi : (int)v;
+}
+
+static void apply_pilot(sim_bulb_t *bulb, const char *params) {
+  long v;
+  bool on;
+
+  if (find_bool(params, "state", &on))
+    bulb->state = on;
+  if (find_int(params, "dimming", &v))
+    bulb->dimming = clamp(v, 10, 100);
+  if (find_int(params, "speed", &v))
+    bulb->speed = clamp(v, 10, 200);
+
+  // a colour, a temperature and a scene exclude each other
+  if (find_int(params, "r", &v)) {
+    bulb->r = clamp(v, 0, 255);
+    bulb->g = find_int(params, "g", &v) ? clamp(v, 0, 255) : 0;
+    bulb->b = find_int(params, "b", &v) ? clamp(v, 0, 255) : 0;
+    bulb->c = find_int(params, "c", &v) ? clamp(v, 0, 255) : 0;
+    bulb->w = find_int(params, "w", &v) ? clamp(v, 0, 255) : 0;
+    bulb->temp = 0;
+    bulb->scene_id = 0;
+  } else if (find_int(params, "temp", &v)) {
+    bulb->temp = clamp(v, 2200, 6500);
+    bulb->scene_id = 0;
+  } else if (find_int(params, "sceneId", &v)) {
+    bulb->scene_id = clamp(v, 0, 1000);
+  }
+}
+
+static int format_pilot(const sim_bulb_t *bulb, const char *mac, char *out,
+                        size_t size) {
+  return snprintf(out, size,
+                  "\"mac\":\"%s\",\"rssi\":-55,\"state\":%s,\"sceneId\":%d,"
+                  "\"r\":%d,\"g\":%d,\"b\":%d,\"c\":%d,\"w\":%d,"
+                  "\"temp\":%d,\"speed\":%d,\"dimming\":%d",
+                  mac, bulb->state ? "true" : "false", bulb->scene_id,
+                  bulb->r, bulb->g, bulb->b, bulb->c, bulb->w, bulb->temp,
+                  bulb->speed, bulb->dimming);
+}
+
+// syncPilot to the registered phone, the way bulbs report changes
+static void push_state(int index, uint64_t now) {
+  sim_bulb_t *bulb = &sim.bulbs[index];
+  if (!bulb->phone_ip)
+    return;
+
+  char mac[13], pilot[384], message[SIM_MESSAGE_MAX];
+  bulb_mac(index, mac);
+  format_pilot(bulb, mac, pilot, sizeof(pilot));
+  int len = snprintf(message, sizeof(message),
+                     "{\"method\":\"syncPilot\",\"env\":\"pro\","
+                     "\"params\":{%s,\"src\":\"udp\"}}",
+                     pilot);
+
+  struct sockaddr_in to;
+  memset(&to, 0, sizeof(to));
+  to.sin_family = AF_INET;
+  to.sin_port = htons(SIM_PUSH_PORT);
+  to.sin_addr.s_addr = bulb->phone_ip;
+  schedule(bulb_addr(index), &to, message, (size_t)len, now);
+  sim.stats.pushes++;
+}
+
+// build and queue the answer of bulb `index` to one request
+static void answer(int index, const char *request,
+                   const struct sockaddr_in *client, uint64_t now) {
+  sim_bulb_t *bulb = &sim.bulbs[index];
+  char method[32], mac[13], body[512], message[SIM_MESSAGE_MAX];
+  char id[24] = "";
+  long id_value;
+  bool changed = false;
+
+  if (!find_string(request, "method", method, sizeof(method))) {
+    sim.stats.ignored++;
+    return;
+  }
+
+  // only a numeric top-level id is echoed; registration carries a string id
+  // inside its params
+  if (!bulb->no_id && find_int(request, "id", &id_value))
+    snprintf(id, sizeof(id), "\"id\":%ld,", id_value);
+
+  const char *params = find_value(request, "params");
+  if (!params)
+    params = "";
+
+  bulb_mac(index, mac);
+  if (strcmp(method, "getPilot") == 0) {
+    char pilot[384];
+    format_pilot(bulb, mac, pilot, sizeof(pilot));
+    snprintf(body, sizeof(body), "\"result\":{%s}", pilot);
+  } else if (strcmp(method, "setPilot") == 0) {
+    apply_pilot(bulb, params);
+    changed = true;
+    snprintf(body, sizeof(body), "\"result\":{\"success\":true}");
+  } else if (strcmp(method, "getSystemConfig") == 0) {
+    snprintf(body, sizeof(body),
+             "\"result\":{\"mac\":\"%s\",\"homeId\":4242,\"roomId\":%d,"
+             "\"moduleName\":\"ESP01_SHRGB_03\",\"fwVersion\":\"1.25.0\","
+             "\"groupId\":0}",
+             mac, index / 16 + 1);
+  } else if (strcmp(method, "registration") == 0) {
+    bool reg = false;
+    char phone[INET_ADDRSTRLEN];
+    if (find_bool(params, "register", &reg) && reg &&
+        find_string(params, "phoneIp", phone, sizeof(phone))) {
+      struct in_addr addr;
+      if (inet_pton(AF_INET, phone, &addr) == 1) {
+        bulb->phone_ip = addr.s_addr;
+        changed = true;
+      }
+    }
+    snprintf(body, sizeof(body), "\"result\":{\"mac\":\"%s\",\"success\":true}",
+             mac);
+  } else {
+    snprintf(body, sizeof(body),
+             "\"error\":{\"code\":-32601,\"message\":\"Method not found\"}");
+  }
+
+  int len = snprintf(message, sizeof(message),
+                     "{\"method\":\"%s\",%s\"env\":\"pro\",%s}", method, id,
+                     body);
+  schedule(bulb_addr(index), client, message, (size_t)len, now);
+  sim.stats.replies++;
+
+  // a copy that lost its id on the way and turns up after the next request:
+  // only the method ties it to anything
+  if (id[0] && chance(sim.stripped)) {
+    len = snprintf(message, sizeof(message),
+                   "{\"method\":\"%s\",\"env\":\"pro\",%s}", method, body);
+    schedule(bulb_addr(index), client, message, (size_t)len,
+             now + (uint64_t)(sim.reorder_ms * 1000.0));
+    sim.stats.stripped++;
+  }
+
+  if (changed)
+    push_state(index, now);
+}
+
+static void handle(const char *request, uint32_t dst,
+                   const struct sockaddr_in *client, uint64_t now) {
+  sim.stats.requests++;
+
+  // the request itself can be lost on the way in
+  if (chance(sim.loss)) {
+    sim.stats.lost++;
+    return;
+  }
+
+  int index = bulb_index(dst);
+  if (index >= 0) {
+    if (sim.bulbs[index].dead) {
+      sim.stats.dead++;
+      return;
+    }
+    answer(index, request, client, now);
+    return;
+  }
+
+  // a broadcast registration is answered by every live bulb
+  if (strstr(request, "\"registration\"")) {
+    for (int i = 0; i < sim.count; i++)
+      if (!sim.bulbs[i].dead)
+        answer(i, request, client, now);
+    return;
+  }
+
+  sim.stats.ignored++;
+}
+
+static void receive_all(void) {
+  uint64_t now = now_us();
+
+  for (;;) {
+    char buffer[SIM_MESSAGE_MAX];
+    char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    struct sockaddr_in client;
+    struct iovec iov = {buffer, sizeof(buffer) - 1};
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &client;
+    msg.msg_namelen = sizeof(client);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(sim.sock, &msg, MSG_DONTWAIT);
+    if (received < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    buffer[received] = '\0';
+
+    uint32_t dst = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
+        dst = ((struct in_pktinfo *)CMSG_DATA(cmsg))->ipi_addr.s_addr;
+    }
+
+    handle(buffer, dst, &client, now);
+  }
+}
+
+static void print_stats(void) {
+  fprintf(stderr,
+          "wizsim: requests=%llu replies=%llu pushes=%llu lost=%llu "
+          "dead=%llu duplicated=%llu stripped=%llu reordered=%llu "
+          "ignored=%llu\n",
+          (unsigned long long)sim.stats.requests,
+          (unsigned long long)sim.stats.replies,
+          (unsigned long long)sim.stats.pushes,
+          (unsigned long long)sim.stats.lost,
+          (unsigned long long)sim.stats.dead,
+          (unsigned long long)sim.stats.duplicated,
+          (unsigned long long)sim.stats.stripped,
+          (unsigned long long)sim.stats.reordered,
+          (unsigned long long)sim.stats.ignored);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -n COUNT     emulated bulbs (default 256)\n"
+          "  -a ADDRESS   first bulb address (default 127.0.1.1)\n"
+          "  -p PORT      port to answer on (default 38899)\n"
+          "  -l LATENCY   reply delay in ms (default const:1):\n"
+          "               const:MS, uniform:MIN:MAX, exp:MIN:MEAN,\n"
+          "               pareto:MIN:SHAPE\n"
+          "  -L PERCENT   loss per datagram, each direction\n"
+          "  -r PERCENT   replies held back so later ones overtake them\n"
+          "  -R MS        extra delay of held-back replies (default 50)\n"
+          "  -u PERCENT   replies sent twice\n"
+          "  -D PERCENT   replies followed by a copy without the request id,\n"
+          "               held back like -r\n"
+          "  -i PERCENT   bulbs whose firmware never echoes the request id\n"
+          "  -x PERCENT   bulbs that never answer\n"
+          "  -X ADDRESS   a specific bulb that never answers (repeatable)\n"
+          "  -s SEED      random seed (default 1)\n"
+          "  -t SECONDS   exit after this long (default: until signalled)\n"
+          "  -q           no per-datagram error messages\n",
+          prog);
+}
+
+int main(int argc, char **argv) {
+  const char *first = "127.0.1.1";
+  int port = SIM_PORT;
+  double dead_percent = 0;
+  double no_id_percent = 0;
+  double duration = 0;
+  const char *dead_list[64];
+  int dead_count = 0;
+  uint64_t seed = 1;
+
+  sim.count = 256;
+  sim.latency = (latency_t){LAT_CONST, 1, 0};
+  sim.reorder_ms = 50;
+  sim.pending_free = -1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:a:p:l:L:r:R:u:D:i:x:X:s:t:qh")) != -1) {
+    switch (opt) {
+    case 'n':
+      sim.count = atoi(optarg);
+      break;
+    case 'a':
+      first = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'l':
+      if (parse_latency(optarg, &sim.latency) < 0) {
+        fprintf(stderr, "wizsim: bad latency '%s'\n", optarg);
+        return 2;
+      }
+      break;
+    case 'L':
+      sim.loss = atof(optarg) / 100.0;
+      break;
+    case 'r':
+      sim.reorder = atof(optarg) / 100.0;
+      break;
+    case 'R':
+      sim.reorder_ms = atof(optarg);
+      break;
+    case 'u':
+      sim.duplicate = atof(optarg) / 100.0;
+      break;
+    case 'D':
+      sim.stripped = atof(optarg) / 100.0;
+      break;
+    case 'i':
+      no_id_percent = atof(optarg);
+      break;
+    case 'x':
+      dead_percent = atof(optarg);
+      break;
+    case 'X':
+      if (dead_count < 64)
+        dead_list[dead_count++] = optarg;
+      break;
+    case 's':
+      seed = strtoull(optarg, NULL, 10);
+      break;
+    case 't':
+      duration = atof(optarg);
+      break;
+    case 'q':
+      sim.quiet = true;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+
+  struct in_addr first_addr;
+  if (sim.count <= 0 || inet_pton(AF_INET, first, &first_addr) != 1) {
+    usage(argv[0]);
+    return 2;
+  }
+  sim.first = ntohl(first_addr.s_addr);
+  sim.rng = seed ? seed : 1;
+
+  sim.bulbs = (sim_bulb_t *)calloc((size_t)sim.count, sizeof(sim_bulb_t));
+  if (!sim.bulbs) {
+    perror("wizsim");
+    return 1;
+  }
+  for (int i = 0; i < sim.count; i++) {
+    sim.bulbs[i].state = true;
+    sim.bulbs[i].dimming = 100;
+    sim.bulbs[i].temp = 2700;
+    sim.bulbs[i].speed = 100;
+    sim.bulbs[i].dead = chance(dead_percent / 100.0);
+    sim.bulbs[i].no_id = chance(no_id_percent / 100.0);
+  }
+  for (int i = 0; i < dead_count; i++) {
+    struct in_addr addr;
+    int index;
+    if (inet_pton(AF_INET, dead_list[i], &addr) == 1 &&
+        (index = bulb_index(addr.s_addr)) >= 0)
+      sim.bulbs[index].dead = true;
+  }
+
+  sim.sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sim.sock < 0) {
+    perror("wizsim: socket");
+    return 1;
+  }
+
+  int one = 1;
+  int buffer_size = SIM_SOCKET_BUFFER;
+  setsockopt(sim.sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(sim.sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+  setsockopt(sim.sock, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+  if (setsockopt(sim.sock, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one)) < 0) {
+    perror("wizsim: IP_PKTINFO");
+    return 1;
+  }
+
+  struct sockaddr_in bind_addr;
+  memset(&bind_addr, 0, sizeof(bind_addr));
+  bind_addr.sin_family = AF_INET;
+  bind_addr.sin_port = htons((uint16_t)port);
+  bind_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(sim.sock, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) < 0) {
+    perror("wizsim: bind");
+    return 1;
+  }
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  struct in_addr last_addr = {bulb_addr(sim.count - 1)};
+  char last[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &last_addr, last, sizeof(last));
+  fprintf(stderr, "wizsim: %d bulbs %s..%s on port %d\n", sim.count, first,
+          last, port);
+
+  uint64_t end = duration > 0 ? now_us() + (uint64_t)(duration * 1e6) : 0;
+  struct pollfd pfd = {sim.sock, POLLIN, 0};
+
+  while (!stop) {
+    uint64_t now = now_us();
+    deliver_due(now);
+    if (end && now >= end)
+      break;
+
+    // sleep until the next delivery, the end of the run or a request
+    struct timespec timeout;
+    struct timespec *wait = NULL;
+    uint64_t until = sim.timer_count > 0 ? sim.timers[0].due_us : 0;
+    if (end && (!until || end < until))
+      until = end;
+    if (until) {
+      uint64_t delta = until > now ? until - now : 0;
+      timeout.tv_sec = (time_t)(delta / 1000000);
+      timeout.tv_nsec = (long)(delta % 1000000) * 1000;
+      wait = &timeout;
+    }
+
+    int ready = ppoll(&pfd, 1, wait, NULL);
+    if (ready < 0 && errno != EINTR) {
+      perror("wizsim: ppoll");
+      break;
+    }
+    if (ready > 0)
+      receive_all();
+  }
+
+  print_stats();
+  close(sim.sock);
+  free(sim.bulbs);
+  free(sim.timers);
+  free(sim.pending);
+  return 0;
+}